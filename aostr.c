@@ -330,7 +330,7 @@ aoStrCatPrintf(aoStr *b, const char *fmt, ...)
     while (1) {
         buf[bufferlen - 2] = '\0';
         va_copy(copy, ap);
-        vsnprintf(buf, bufferlen, fmt, ap);
+        vsnprintf(buf, bufferlen, fmt, copy);
         va_end(copy);
         if (buf[bufferlen - 2] != '\0') {
             free(buf);
@@ -0,0 +1,101 @@
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "arena.h"
+
+#define ARENA_ALIGN sizeof(void *)
+
+arena *
+arenaCreate(void)
+{
+    arena *a;
+
+    if ((a = malloc(sizeof(arena))) == NULL)
+        return NULL;
+
+    a->blocks = NULL;
+    a->used = 0;
+    a->allocated = 0;
+    return a;
+}
+
+void
+arenaRelease(arena *a)
+{
+    arenaBlock *b, *next;
+
+    if (a) {
+        for (b = a->blocks; b; b = next) {
+            next = b->next;
+            free(b);
+        }
+        free(a);
+    }
+}
+
+static arenaBlock *
+_arenaBlockCreate(size_t size)
+{
+    arenaBlock *b;
+
+    if ((b = malloc(sizeof(arenaBlock) + size)) == NULL)
+        return NULL;
+
+    b->size = size;
+    b->used = 0;
+    b->data = (char *)(b + 1);
+    return b;
+}
+
+void *
+arenaAlloc(arena *a, size_t size)
+{
+    arenaBlock *b = a->blocks;
+    void *ptr;
+
+    size = (size + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+
+    if (b == NULL || b->size - b->used < size) {
+        /* Anything too big for a block gets one to itself, behind the one
+         * being filled so the space left there is not lost */
+        if (size > ARENA_BLOCK_SIZE / 4) {
+            if ((b = _arenaBlockCreate(size)) == NULL)
+                return NULL;
+            if (a->blocks) {
+                b->next = a->blocks->next;
+                a->blocks->next = b;
+            } else {
+                b->next = NULL;
+                a->blocks = b;
+            }
+        } else {
+            if ((b = _arenaBlockCreate(ARENA_BLOCK_SIZE)) == NULL)
+                return NULL;
+            b->next = a->blocks;
+            a->blocks = b;
+        }
+        a->allocated += sizeof(arenaBlock) + b->size;
+    }
+
+    ptr = b->data + b->used;
+    b->used += size;
+    a->used += size;
+    return ptr;
+}
+
+int
+arenaOwns(arena *a, void *ptr)
+{
+    uintptr_t p = (uintptr_t)ptr;
+
+    for (arenaBlock *b = a->blocks; b; b = b->next)
+        if (p >= (uintptr_t)b->data && p < (uintptr_t)b->data + b->used)
+            return 1;
+    return 0;
+}
+
+size_t
+arenaMemoryUsage(arena *a)
+{
+    return sizeof(arena) + a->allocated;
+}
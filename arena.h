@@ -0,0 +1,33 @@
+#ifndef __ARENA_H__
+#define __ARENA_H__
+
+#include <stddef.h>
+
+/* A bump allocator for data that lives as long as the arena. Nothing is
+ * freed on its own, everything goes at once in arenaRelease. Not thread
+ * safe, each loader wants its own */
+
+#define ARENA_BLOCK_SIZE (4 * 1024 * 1024)
+
+typedef struct arenaBlock {
+    struct arenaBlock *next;
+    size_t size;
+    size_t used;
+    char *data;
+} arenaBlock;
+
+typedef struct arena {
+    arenaBlock *blocks; /* the head is the one being filled */
+    size_t used;
+    size_t allocated;
+} arena;
+
+arena *arenaCreate(void);
+void arenaRelease(arena *a);
+void *arenaAlloc(arena *a, size_t size);
+/* Whether `ptr` was handed out by this arena */
+int arenaOwns(arena *a, void *ptr);
+/* Bytes requested from the system */
+size_t arenaMemoryUsage(arena *a);
+
+#endif
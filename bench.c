@@ -0,0 +1,617 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "aostr.h"
+#include "dbclient.h"
+#include "hmap.h"
+#include "panic.h"
+#include "swmap.h"
+
+/* Micro benchmarks for the pieces the server is built from, each group
+ * prints nanoseconds per operation, db prints rows per second.
+ *
+ * ./dict-bench [group ...]   with no group all of them run */
+
+#define BENCH_RUNS    5 /* the fastest is reported */
+#define BENCH_LOOKUPS 2000000
+#define BENCH_CHURN   2000000
+/* About how many words are being fetched at once under load */
+#define BENCH_INFLIGHT 64
+#define BENCH_HASHES   2000000
+/* 2^BENCH_FLOOD_BITS keys that all collide under the old string hash */
+#define BENCH_FLOOD_BITS 13
+/* The database is on disk, these run once rather than BENCH_RUNS times */
+#define BENCH_DB_SINGLE  1000   /* rows inserted one transaction each */
+#define BENCH_DB_ROWS    100000 /* rows inserted in batches */
+#define BENCH_DB_BATCH   64
+#define BENCH_DB_LOOKUPS 200000
+
+/* The table and statements as the server has them */
+#define BENCH_SQL_CREATE \
+    "CREATE TABLE dict (word TEXT NOT NULL, definitions TEXT);" \
+    "CREATE UNIQUE INDEX dict_word_unique ON dict (word);"
+#define BENCH_SQL_INSERT \
+    "INSERT INTO dict (word, definitions) VALUES (?1, ?2)" \
+    " ON CONFLICT (word) DO UPDATE SET definitions = excluded.definitions;"
+#define BENCH_SQL_LOOKUP "SELECT definitions FROM dict WHERE word = ?1;"
+
+typedef struct benchKeys {
+    int count;
+    char **keys;
+    char **misses;
+    int *order; /* a shuffled index into keys */
+} benchKeys;
+
+static unsigned long long
+benchNs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void
+benchBest(unsigned long long *best, unsigned long long ns)
+{
+    if (*best == 0 || ns < *best)
+        *best = ns;
+}
+
+static unsigned long long benchState = 0x9E3779B97F4A7C15ULL;
+
+static unsigned int
+benchRandom(void)
+{
+    benchState ^= benchState << 13;
+    benchState ^= benchState >> 7;
+    benchState ^= benchState << 17;
+    return (unsigned int)benchState;
+}
+
+static char *
+benchWord(const char *prefix, unsigned int num)
+{
+    char buf[64];
+    snprintf(buf, sizeof(buf), "%s%u", prefix, num);
+    return strdup(buf);
+}
+
+static benchKeys *
+benchKeysCreate(int count)
+{
+    benchKeys *bk;
+
+    if ((bk = malloc(sizeof(benchKeys))) == NULL)
+        panic("Failed to allocate keys\n");
+
+    bk->count = count;
+    bk->keys = malloc(sizeof(char *) * count);
+    bk->misses = malloc(sizeof(char *) * count);
+    bk->order = malloc(sizeof(int) * count);
+    if (!bk->keys || !bk->misses || !bk->order)
+        panic("Failed to allocate keys\n");
+
+    for (int i = 0; i < count; ++i) {
+        bk->keys[i] = benchWord("word", i);
+        bk->misses[i] = benchWord("miss", i);
+        bk->order[i] = i;
+    }
+
+    for (int i = count - 1; i > 0; --i) {
+        int j = benchRandom() % (i + 1);
+        int tmp = bk->order[i];
+        bk->order[i] = bk->order[j];
+        bk->order[j] = tmp;
+    }
+
+    return bk;
+}
+
+static void
+benchKeysRelease(benchKeys *bk)
+{
+    for (int i = 0; i < bk->count; ++i) {
+        free(bk->keys[i]);
+        free(bk->misses[i]);
+    }
+    free(bk->keys);
+    free(bk->misses);
+    free(bk->order);
+    free(bk);
+}
+
+/* Keys and values belong to the benchmark */
+static hmapType benchMapType = {
+    .keycmp = hmapStrCmp,
+    .hashFn = hmapHashString,
+    .freekey = NULL,
+    .freevalue = NULL,
+};
+
+/* Both tables behind the same calls so each run does exactly the same work */
+typedef struct benchMapOps {
+    void *(*create)(void);
+    void (*release)(void *map);
+    void (*add)(void *map, char *key);
+    void *(*get)(void *map, char *key);
+    void (*del)(void *map, char *key);
+    size_t (*bytes)(void *map);
+} benchMapOps;
+
+static void *benchHmapCreate(void) { return hmapCreateWithType(&benchMapType); }
+static void benchHmapRelease(void *m) { hmapRelease(m); }
+static void benchHmapAdd(void *m, char *key) { hmapAdd(m, key, key); }
+static void *benchHmapGet(void *m, char *key) { return hmapGet(m, key); }
+static void benchHmapDel(void *m, char *key) { free(hmapDelete(m, key)); }
+static size_t benchHmapBytes(void *m) { return hmapMemoryUsage(m); }
+
+static void *benchSwmapCreate(void) { return swmapCreate(&benchMapType); }
+static void benchSwmapRelease(void *m) { swmapRelease(m); }
+static void benchSwmapAdd(void *m, char *key) { swmapAdd(m, key, key); }
+static void *benchSwmapGet(void *m, char *key) { return swmapGet(m, key); }
+static void benchSwmapDel(void *m, char *key) { swmapDelete(m, key); }
+static size_t benchSwmapBytes(void *m) { return swmapMemoryUsage(m); }
+
+static benchMapOps benchMaps[2] = {
+    {benchHmapCreate, benchHmapRelease, benchHmapAdd, benchHmapGet,
+            benchHmapDel, benchHmapBytes},
+    {benchSwmapCreate, benchSwmapRelease, benchSwmapAdd, benchSwmapGet,
+            benchSwmapDel, benchSwmapBytes},
+};
+
+/* Insert, hit and miss at one size, the best of BENCH_RUNS for each */
+static void
+benchMapSize(int count)
+{
+    benchKeys *bk = benchKeysCreate(count);
+    unsigned long long start, ns[2][3] = {{0}};
+    size_t found, bytes[2];
+    benchMapOps *ops;
+    void *map;
+
+    for (int run = 0; run < BENCH_RUNS; ++run) {
+        for (int m = 0; m < 2; ++m) {
+            ops = &benchMaps[m];
+            if ((map = ops->create()) == NULL)
+                panic("Failed to create map\n");
+
+            start = benchNs();
+            for (int i = 0; i < count; ++i)
+                ops->add(map, bk->keys[i]);
+            benchBest(&ns[m][0], benchNs() - start);
+
+            found = 0;
+            start = benchNs();
+            for (int i = 0; i < BENCH_LOOKUPS; ++i)
+                found += ops->get(map, bk->keys[bk->order[i % count]]) != NULL;
+            benchBest(&ns[m][1], benchNs() - start);
+
+            start = benchNs();
+            for (int i = 0; i < BENCH_LOOKUPS; ++i)
+                found += ops->get(map, bk->misses[bk->order[i % count]]) !=
+                        NULL;
+            benchBest(&ns[m][2], benchNs() - start);
+
+            if (found != BENCH_LOOKUPS)
+                panic("Lookups found %zu keys, wanted %d\n", found,
+                        BENCH_LOOKUPS);
+
+            bytes[m] = ops->bytes(map);
+            ops->release(map);
+        }
+    }
+
+    printf("%-9d %-8s %8.1f %8.1f\n", count, "insert",
+            (double)ns[0][0] / count, (double)ns[1][0] / count);
+    printf("%-9d %-8s %8.1f %8.1f\n", count, "hit",
+            (double)ns[0][1] / BENCH_LOOKUPS,
+            (double)ns[1][1] / BENCH_LOOKUPS);
+    printf("%-9d %-8s %8.1f %8.1f\n", count, "miss",
+            (double)ns[0][2] / BENCH_LOOKUPS,
+            (double)ns[1][2] / BENCH_LOOKUPS);
+    printf("%-9d %-8s %8.1f %8.1f\n", count, "bytes",
+            (double)bytes[0] / count, (double)bytes[1] / count);
+
+    benchKeysRelease(bk);
+}
+
+/* What the in-flight table sees, each miss adds its word, the words waiting
+ * on it look it up and it is deleted when the fetch completes */
+static void
+benchMapChurn(void)
+{
+    benchKeys *bk = benchKeysCreate(BENCH_CHURN);
+    unsigned long long start, ns[2] = {0};
+    size_t found, bytes[2];
+    benchMapOps *ops;
+    void *map;
+
+    for (int run = 0; run < BENCH_RUNS; ++run) {
+        for (int m = 0; m < 2; ++m) {
+            ops = &benchMaps[m];
+            if ((map = ops->create()) == NULL)
+                panic("Failed to create map\n");
+
+            found = 0;
+            start = benchNs();
+            for (int i = 0; i < BENCH_CHURN; ++i) {
+                ops->add(map, bk->keys[i]);
+                found += ops->get(map, bk->keys[i]) != NULL;
+                if (i >= BENCH_INFLIGHT)
+                    ops->del(map, bk->keys[i - BENCH_INFLIGHT]);
+            }
+            benchBest(&ns[m], benchNs() - start);
+
+            if (found != BENCH_CHURN)
+                panic("Churn found %zu keys, wanted %d\n", found,
+                        BENCH_CHURN);
+
+            bytes[m] = ops->bytes(map);
+            ops->release(map);
+        }
+    }
+
+    printf("%-9d %-8s %8.1f %8.1f\n", BENCH_INFLIGHT, "churn",
+            (double)ns[0] / BENCH_CHURN, (double)ns[1] / BENCH_CHURN);
+    printf("%-9d %-8s %8zu %8zu\n", BENCH_INFLIGHT, "bytes", bytes[0],
+            bytes[1]);
+
+    benchKeysRelease(bk);
+}
+
+/* The chained hmap against the swiss table with string keys */
+static void
+benchMap(void)
+{
+    printf("map: ns per op, bytes per entry or for the whole churn table\n");
+    printf("%-9s %-8s %8s %8s\n", "size", "op", "hmap", "swmap");
+    benchMapChurn();
+    benchMapSize(BENCH_INFLIGHT);
+    benchMapSize(50000);
+    benchMapSize(1000000);
+}
+
+/* The 31 multiplier hash hmap used before it was seeded */
+static unsigned int
+benchHashJava(void *key)
+{
+    char *s = key;
+    unsigned int h = (unsigned int)*s;
+
+    if (h) {
+        for (++s; *s; ++s)
+            h = (h << 5) - h + (unsigned int)*s;
+    }
+
+    return h;
+}
+
+static hmapType benchJavaType = {
+    .keycmp = hmapStrCmp,
+    .hashFn = benchHashJava,
+    .freekey = NULL,
+    .freevalue = NULL,
+};
+
+static hmapType benchAoStrType = {
+    .keycmp = hmapAoStrCmp,
+    .hashFn = hmapHashAoStr,
+    .freekey = NULL,
+    .freevalue = NULL,
+};
+
+/* Hashing alone, for keys of a few lengths */
+static void
+benchHashLengths(void)
+{
+    static const int lens[] = {4, 8, 16, 32, 64, 256};
+    static char keys[1024][257];
+    unsigned long long start, ns[2];
+    volatile unsigned int sink = 0;
+
+    printf("%-9s %8s %8s\n", "keylen", "java", "wyhash");
+    for (size_t l = 0; l < sizeof(lens) / sizeof(lens[0]); ++l) {
+        for (int k = 0; k < 1024; ++k) {
+            for (int i = 0; i < lens[l]; ++i)
+                keys[k][i] = 'a' + benchRandom() % 26;
+            keys[k][lens[l]] = '\0';
+        }
+        ns[0] = ns[1] = 0;
+
+        for (int run = 0; run < BENCH_RUNS; ++run) {
+            start = benchNs();
+            for (int i = 0; i < BENCH_HASHES; ++i)
+                sink += benchHashJava(keys[i & 1023]);
+            benchBest(&ns[0], benchNs() - start);
+
+            start = benchNs();
+            for (int i = 0; i < BENCH_HASHES; ++i)
+                sink += hmapHashString(keys[i & 1023]);
+            benchBest(&ns[1], benchNs() - start);
+        }
+
+        printf("%-9d %8.1f %8.1f\n", lens[l], (double)ns[0] / BENCH_HASHES,
+                (double)ns[1] / BENCH_HASHES);
+    }
+    (void)sink;
+}
+
+/* A hit in a table of 50k words keyed the old way, by string with wyhash
+ * and by aoStr */
+static void
+benchHashLookups(void)
+{
+    benchKeys *bk = benchKeysCreate(50000);
+    hmapType *types[3] = {&benchJavaType, &benchMapType, &benchAoStrType};
+    unsigned long long start, ns[3] = {0};
+    aoStr *strs;
+    size_t found;
+    void *key;
+    hmap *h;
+
+    if ((strs = malloc(sizeof(aoStr) * bk->count)) == NULL)
+        panic("Failed to allocate keys\n");
+    for (int i = 0; i < bk->count; ++i)
+        strs[i] = (aoStr){.data = bk->keys[i], .len = strlen(bk->keys[i])};
+
+    for (int run = 0; run < BENCH_RUNS; ++run) {
+        for (int t = 0; t < 3; ++t) {
+            if ((h = hmapCreateWithType(types[t])) == NULL)
+                panic("Failed to create map\n");
+            for (int i = 0; i < bk->count; ++i) {
+                key = t == 2 ? (void *)&strs[i] : bk->keys[i];
+                hmapAdd(h, key, key);
+            }
+
+            found = 0;
+            start = benchNs();
+            for (int i = 0; i < BENCH_LOOKUPS; ++i) {
+                int idx = bk->order[i % bk->count];
+                key = t == 2 ? (void *)&strs[idx] : bk->keys[idx];
+                found += hmapGet(h, key) != NULL;
+            }
+            benchBest(&ns[t], benchNs() - start);
+
+            if (found != BENCH_LOOKUPS)
+                panic("Lookups found %zu keys, wanted %d\n", found,
+                        BENCH_LOOKUPS);
+            hmapRelease(h);
+        }
+    }
+
+    printf("%-9s %8.1f %8.1f %8.1f\n", "hit", (double)ns[0] / BENCH_LOOKUPS,
+            (double)ns[1] / BENCH_LOOKUPS, (double)ns[2] / BENCH_LOOKUPS);
+
+    free(strs);
+    benchKeysRelease(bk);
+}
+
+/* "Aa" and "BB" hash the same under the old hash, so do all strings made
+ * of them. Adding and then finding every one of them */
+static void
+benchHashFlood(void)
+{
+    int count = 1 << BENCH_FLOOD_BITS;
+    hmapType *types[3] = {&benchJavaType, &benchMapType, &benchAoStrType};
+    unsigned long long start, ns[3];
+    char **keys;
+    aoStr *strs;
+    void *key;
+    hmap *h;
+
+    keys = malloc(sizeof(char *) * count);
+    strs = malloc(sizeof(aoStr) * count);
+    if (keys == NULL || strs == NULL)
+        panic("Failed to allocate keys\n");
+
+    for (int i = 0; i < count; ++i) {
+        if ((keys[i] = malloc(BENCH_FLOOD_BITS * 2 + 1)) == NULL)
+            panic("Failed to allocate keys\n");
+        for (int b = 0; b < BENCH_FLOOD_BITS; ++b)
+            memcpy(keys[i] + b * 2, (i >> b) & 1 ? "BB" : "Aa", 2);
+        keys[i][BENCH_FLOOD_BITS * 2] = '\0';
+        strs[i] = (aoStr){.data = keys[i], .len = BENCH_FLOOD_BITS * 2};
+    }
+
+    for (int t = 0; t < 3; ++t) {
+        if ((h = hmapCreateWithType(types[t])) == NULL)
+            panic("Failed to create map\n");
+
+        start = benchNs();
+        for (int i = 0; i < count; ++i) {
+            key = t == 2 ? (void *)&strs[i] : keys[i];
+            hmapAdd(h, key, key);
+        }
+        for (int i = 0; i < count; ++i) {
+            key = t == 2 ? (void *)&strs[i] : keys[i];
+            if (hmapGet(h, key) == NULL)
+                panic("Flood lost a key\n");
+        }
+        ns[t] = benchNs() - start;
+        hmapRelease(h);
+    }
+
+    printf("%-9s %8.1f %8.1f %8.1f\n", "flood",
+            (double)ns[0] / (2 * count), (double)ns[1] / (2 * count),
+            (double)ns[2] / (2 * count));
+
+    for (int i = 0; i < count; ++i)
+        free(keys[i]);
+    free(keys);
+    free(strs);
+}
+
+/* The old string hash against seeded wyhash */
+static void
+benchHash(void)
+{
+    printf("hash: ns per hash\n");
+    benchHashLengths();
+    printf("\nhash: ns per op, %d colliding keys for flood\n",
+            1 << BENCH_FLOOD_BITS);
+    printf("%-9s %8s %8s %8s\n", "op", "java", "string", "aostr");
+    benchHashLookups();
+    benchHashFlood();
+}
+
+/* dbConnect applies the profile, this puts sqlite's defaults back */
+static char *benchDbDefaults[] = {
+    "PRAGMA journal_mode=DELETE;",
+    "PRAGMA synchronous=FULL;",
+    "PRAGMA mmap_size=0;",
+    "PRAGMA cache_size=-2000;",
+};
+
+static int
+benchDbInsert(dbClient *db, benchKeys *bk, int from, int count, int batch,
+        char *definition)
+{
+    dbStmt *stmt = dbStmtGet(db, BENCH_SQL_INSERT);
+
+    for (int i = from; i < from + count; i += batch) {
+        if (batch > 1 && !dbExec(db, "BEGIN;"))
+            return DB_ERR;
+        for (int j = i; j < i + batch && j < from + count; ++j) {
+            if (!dbStmtBindText(stmt, 1, bk->keys[j], strlen(bk->keys[j])) ||
+                    !dbStmtBindText(stmt, 2, definition,
+                            strlen(definition)) ||
+                    dbStmtStep(stmt) == DB_ERR) {
+                dbStmtReset(stmt);
+                return DB_ERR;
+            }
+            dbStmtReset(stmt);
+        }
+        if (batch > 1 && !dbExec(db, "COMMIT;"))
+            return DB_ERR;
+    }
+
+    return DB_OK;
+}
+
+/* Rows per second for one profile on a new database in `dir` */
+static void
+benchDbProfile(char *dir, int tuned, benchKeys *bk, double *rates)
+{
+    char path[256], definition[256], *found;
+    unsigned long long start;
+    int len, idx, hits = 0;
+    dbClient *db;
+
+    snprintf(path, sizeof(path), "%s/%s.db", dir, tuned ? "tuned" : "plain");
+    if ((db = dbConnect(path)) == NULL)
+        panic("Failed to open %s\n", path);
+
+    if (!tuned)
+        for (size_t i = 0; i < sizeof(benchDbDefaults) / sizeof(char *); ++i)
+            if (!dbExec(db, benchDbDefaults[i]))
+                panic("Failed to run %s\n", benchDbDefaults[i]);
+
+    if (!dbExec(db, BENCH_SQL_CREATE))
+        panic("Failed to create the table\n");
+
+    memset(definition, 'x', sizeof(definition) - 1);
+    definition[sizeof(definition) - 1] = '\0';
+
+    start = benchNs();
+    if (benchDbInsert(db, bk, 0, BENCH_DB_SINGLE, 1, definition) == DB_ERR)
+        panic("Failed to insert\n");
+    rates[0] = BENCH_DB_SINGLE / ((double)(benchNs() - start) / 1e9);
+
+    start = benchNs();
+    if (benchDbInsert(db, bk, BENCH_DB_SINGLE, BENCH_DB_ROWS, BENCH_DB_BATCH,
+                definition) == DB_ERR)
+        panic("Failed to insert\n");
+    rates[1] = BENCH_DB_ROWS / ((double)(benchNs() - start) / 1e9);
+
+    start = benchNs();
+    for (int i = 0; i < BENCH_DB_LOOKUPS; ++i) {
+        idx = bk->order[i % bk->count];
+        found = dbStmtQueryText(dbStmtGet(db, BENCH_SQL_LOOKUP),
+                bk->keys[idx], strlen(bk->keys[idx]), &len);
+        hits += found != NULL;
+        free(found);
+    }
+    rates[2] = BENCH_DB_LOOKUPS / ((double)(benchNs() - start) / 1e9);
+
+    if (hits != BENCH_DB_LOOKUPS)
+        panic("Lookups found %d rows, wanted %d\n", hits, BENCH_DB_LOOKUPS);
+
+    dbRelease(db);
+    unlink(path);
+    len = strlen(path);
+    memcpy(path + len, "-wal", 5);
+    unlink(path);
+    memcpy(path + len, "-shm", 5);
+    unlink(path);
+}
+
+/* sqlite's defaults against the profile dbConnect applies: WAL,
+ * synchronous=NORMAL, mmap_size and a bigger page cache */
+static void
+benchDb(void)
+{
+    char dir[] = "/tmp/dict-bench.XXXXXX";
+    benchKeys *bk = benchKeysCreate(BENCH_DB_SINGLE + BENCH_DB_ROWS);
+    double rates[2][3];
+
+    if (mkdtemp(dir) == NULL)
+        panic("Failed to create %s\n", dir);
+
+    benchDbProfile(dir, 0, bk, rates[0]);
+    benchDbProfile(dir, 1, bk, rates[1]);
+    rmdir(dir);
+
+    printf("db: rows per second, %d rows of 255 bytes\n",
+            BENCH_DB_SINGLE + BENCH_DB_ROWS);
+    printf("%-12s %10s %10s\n", "op", "default", "tuned");
+    printf("%-12s %10.0f %10.0f\n", "insert", rates[0][0], rates[1][0]);
+    printf("batch of %-3d %10.0f %10.0f\n", BENCH_DB_BATCH, rates[0][1],
+            rates[1][1]);
+    printf("%-12s %10.0f %10.0f\n", "lookup", rates[0][2], rates[1][2]);
+
+    benchKeysRelease(bk);
+}
+
+typedef struct benchGroup {
+    char *name;
+    void (*run)(void);
+} benchGroup;
+
+static benchGroup groups[] = {
+    {"map", benchMap},
+    {"hash", benchHash},
+    {"db", benchDb},
+};
+
+int
+main(int argc, char **argv)
+{
+    int count = sizeof(groups) / sizeof(groups[0]), ran = 0;
+
+    hmapInitSeed();
+
+    for (int i = 0; i < count; ++i) {
+        int wanted = argc == 1;
+        for (int j = 1; j < argc; ++j)
+            if (!strcmp(argv[j], groups[i].name))
+                wanted = 1;
+        if (wanted) {
+            if (ran++)
+                printf("\n");
+            groups[i].run();
+        }
+    }
+
+    if (ran == 0) {
+        fprintf(stderr, "Usage: %s [", argv[0]);
+        for (int i = 0; i < count; ++i)
+            fprintf(stderr, "%s%s", i ? "|" : "", groups[i].name);
+        fprintf(stderr, "] ...\n");
+        return 1;
+    }
+
+    return 0;
+}
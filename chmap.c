@@ -0,0 +1,458 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "chmap.h"
+#include "epoch.h"
+#include "hmap.h"
+
+/* Readers see either the old or the new pointer, never a torn one, and
+ * everything written to an entry before it was published */
+#define _chmapLoad(p)     __atomic_load_n(&(p), __ATOMIC_ACQUIRE)
+#define _chmapStore(p, v) __atomic_store_n(&(p), (v), __ATOMIC_RELEASE)
+
+/* Frees come from the epoch on any thread, there may be no chmap left to
+ * hand the hmapEntry macros by then, only its type */
+#define _chmapEntryAlloc(type) \
+    ((type)->allocentry ? (type)->allocentry(sizeof(chmapEntry)) : \
+                          malloc(sizeof(chmapEntry)))
+#define _chmapEntryFree(type, he) \
+    ((type)->freeentry ? (type)->freeentry((he)) : free((he)))
+
+static chmapTable *
+_chmapTableCreate(unsigned int capacity)
+{
+    chmapTable *t;
+
+    if ((t = malloc(sizeof(chmapTable))) == NULL)
+        return NULL;
+
+    if ((t->entries = calloc(capacity, sizeof(chmapEntry *))) == NULL) {
+        free(t);
+        return NULL;
+    }
+
+    t->capacity = capacity;
+    t->mask = capacity - 1;
+    t->rehashfrom = NULL;
+    t->rehashidx = 0;
+    return t;
+}
+
+/* Only the table and its entries, keys and values were copied to the new
+ * table */
+static void
+_chmapTableRelease(void *_t, void *_type)
+{
+    chmapTable *t = _t;
+    hmapType *type = _type;
+    chmapEntry *he, *next;
+
+    for (unsigned int i = 0; i < t->capacity; ++i) {
+        for (he = t->entries[i]; he; he = next) {
+            next = he->next;
+            _chmapEntryFree(type, he);
+        }
+    }
+    free(t->entries);
+    free(t);
+}
+
+static void
+_chmapEntryRelease(void *_he, void *_type)
+{
+    chmapEntry *he = _he;
+    hmapType *type = _type;
+
+    if (type->freekey)
+        type->freekey(he->key);
+    if (type->freevalue)
+        type->freevalue(he->value);
+    _chmapEntryFree(type, he);
+}
+
+chmap *
+chmapCreateWithCapacity(hmapType *type, unsigned int expected)
+{
+    chmap *cm;
+
+    if ((cm = malloc(sizeof(chmap))) == NULL)
+        return NULL;
+
+    hmapInitSeed();
+    if ((cm->table = _chmapTableCreate(hmapCapacityFor(expected))) == NULL) {
+        free(cm);
+        return NULL;
+    }
+
+    cm->type = type;
+    cm->size = 0;
+    cm->rebuildThreashold = (unsigned int)(HM_LOAD * cm->table->capacity);
+    pthread_mutex_init(&cm->lock, NULL);
+
+    return cm;
+}
+
+chmap *
+chmapCreate(hmapType *type)
+{
+    return chmapCreateWithCapacity(type, 0);
+}
+
+static void
+_chmapEntriesRelease(chmap *cm, chmapTable *t, unsigned int from)
+{
+    chmapEntry *he, *next;
+
+    for (unsigned int i = 0; i < t->capacity; ++i) {
+        for (he = t->entries[i]; he; he = next) {
+            next = he->next;
+            if (i >= from)
+                _chmapEntryRelease(he, cm->type);
+            else
+                _chmapEntryFree(cm->type, he);
+        }
+    }
+    free(t->entries);
+    free(t);
+}
+
+void
+chmapRelease(chmap *cm)
+{
+    chmapTable *t;
+
+    if (cm) {
+        t = cm->table;
+        /* Buckets not copied yet hold the only reference to their keys */
+        if (t->rehashfrom)
+            _chmapEntriesRelease(cm, t->rehashfrom, t->rehashidx);
+        _chmapEntriesRelease(cm, t, 0);
+        pthread_mutex_destroy(&cm->lock);
+        free(cm);
+    }
+}
+
+static chmapEntry *
+_chmapFind(chmap *cm, chmapTable *t, void *key, unsigned int hash)
+{
+    chmapEntry *he = _chmapLoad(t->entries[hash & t->mask]);
+
+    while (he) {
+        if (hmapKeycmp(cm, key, hash, he->key, he->hash))
+            return he;
+        he = _chmapLoad(he->next);
+    }
+
+    return NULL;
+}
+
+/* The old table is looked at first. A bucket is copied into the new table
+ * before the copy is visible, so anything missing from the old table that
+ * is not new will be found in the new one */
+void *
+chmapGet(chmap *cm, void *key)
+{
+    chmapTable *t, *old;
+    chmapEntry *he;
+    unsigned int hash;
+
+    hash = hmapHash(cm, key);
+    t = _chmapLoad(cm->table);
+
+    if ((old = _chmapLoad(t->rehashfrom)) != NULL)
+        if ((he = _chmapFind(cm, old, key, hash)) != NULL)
+            return he->value;
+
+    if ((he = _chmapFind(cm, t, key, hash)) != NULL)
+        return he->value;
+
+    return NULL;
+}
+
+/* Must hold the lock. Entries can not be moved between chains while readers
+ * walk them so the bucket is copied, all or nothing so a failed allocation
+ * can be retried */
+static int
+_chmapCopyBucket(hmapType *type, chmapTable *t, chmapEntry *he)
+{
+    chmapEntry *copies = NULL, *copy, *next;
+    unsigned int idx;
+
+    for (; he; he = he->next) {
+        if ((copy = _chmapEntryAlloc(type)) == NULL) {
+            for (; copies; copies = next) {
+                next = copies->next;
+                _chmapEntryFree(type, copies);
+            }
+            return HM_ERR;
+        }
+        copy->key = he->key;
+        copy->value = he->value;
+        copy->hash = he->hash;
+        copy->next = copies;
+        copies = copy;
+    }
+
+    for (copy = copies; copy; copy = next) {
+        next = copy->next;
+        idx = copy->hash & t->mask;
+        copy->next = t->entries[idx];
+        _chmapStore(t->entries[idx], copy);
+    }
+
+    return HM_OK;
+}
+
+/* Must hold the lock */
+static int
+_chmapRehash(chmap *cm, int n)
+{
+    chmapTable *t = cm->table, *old = t->rehashfrom;
+    int emptyvisits = n * 10;
+
+    if (old == NULL)
+        return 0;
+
+    while (n-- && t->rehashidx < old->capacity) {
+        while (old->entries[t->rehashidx] == NULL) {
+            t->rehashidx++;
+            if (t->rehashidx == old->capacity || --emptyvisits == 0)
+                goto done;
+        }
+
+        if (_chmapCopyBucket(cm->type, t, old->entries[t->rehashidx]) == HM_ERR)
+            return 1;
+        t->rehashidx++;
+    }
+
+done:
+    if (t->rehashidx == old->capacity) {
+        _chmapStore(t->rehashfrom, NULL);
+        epochRetire(old, _chmapTableRelease, cm->type);
+        return 0;
+    }
+
+    return 1;
+}
+
+/* Must hold the lock. Only allocates the new table, _chmapRehash copies
+ * the entries over a few buckets at a time */
+static int
+_chmapExpand(chmap *cm)
+{
+    chmapTable *new;
+
+    if ((new = _chmapTableCreate(cm->table->capacity << 1)) == NULL)
+        return HM_ERR;
+
+    new->rehashfrom = cm->table;
+    cm->rebuildThreashold = (unsigned int)(HM_LOAD * new->capacity);
+    _chmapStore(cm->table, new);
+
+    return HM_OK;
+}
+
+int
+chmapRehash(chmap *cm, int n)
+{
+    int more;
+
+    pthread_mutex_lock(&cm->lock);
+    more = _chmapRehash(cm, n);
+    pthread_mutex_unlock(&cm->lock);
+
+    return more;
+}
+
+static long long
+_chmapTimeMs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* Takes the lock per batch so writers are not held up for all of `ms` */
+int
+chmapRehashMilliseconds(chmap *cm, int ms)
+{
+    long long start = _chmapTimeMs();
+    int rehashes = 0;
+
+    while (chmapRehash(cm, 100)) {
+        rehashes += 100;
+        if (_chmapTimeMs() - start > ms)
+            break;
+    }
+
+    return rehashes;
+}
+
+/* Must hold the lock. Only ever into the new table, an unmoved bucket in
+ * the old table is copied as it was and the copy joins whatever is already
+ * here */
+static int
+_chmapInsert(chmap *cm, void *key, void *value, unsigned int hash)
+{
+    chmapTable *t = cm->table;
+    chmapEntry *newHe;
+    unsigned int idx;
+
+    if ((newHe = _chmapEntryAlloc(cm->type)) == NULL)
+        return HM_ERR;
+
+    idx = hash & t->mask;
+    newHe->key = key;
+    newHe->value = value;
+    newHe->hash = hash;
+    newHe->next = t->entries[idx];
+    _chmapStore(t->entries[idx], newHe);
+    __atomic_store_n(&cm->size, cm->size + 1, __ATOMIC_RELAXED);
+
+    return HM_OK;
+}
+
+/* Must hold the lock. Running out of memory here only makes the chains
+ * longer */
+static void
+_chmapGrow(chmap *cm)
+{
+    if (cm->table->rehashfrom)
+        _chmapRehash(cm, HM_REHASH_STEP);
+    else if (cm->size >= cm->rebuildThreashold)
+        _chmapExpand(cm);
+}
+
+int
+chmapAdd(chmap *cm, void *key, void *value)
+{
+    chmapTable *t;
+    unsigned int hash;
+    int retval;
+
+    hash = hmapHash(cm, key);
+
+    pthread_mutex_lock(&cm->lock);
+    _chmapGrow(cm);
+
+    t = cm->table;
+    if ((t->rehashfrom && _chmapFind(cm, t->rehashfrom, key, hash)) ||
+            _chmapFind(cm, t, key, hash))
+        retval = HM_FOUND;
+    else
+        retval = _chmapInsert(cm, key, value, hash);
+    pthread_mutex_unlock(&cm->lock);
+
+    return retval;
+}
+
+int
+chmapAddUnique(chmap *cm, void *key, void *value)
+{
+    unsigned int hash;
+    int retval;
+
+    hash = hmapHash(cm, key);
+
+    pthread_mutex_lock(&cm->lock);
+    _chmapGrow(cm);
+    retval = _chmapInsert(cm, key, value, hash);
+    pthread_mutex_unlock(&cm->lock);
+
+    return retval;
+}
+
+/* Must hold the lock */
+static chmapEntry *
+_chmapUnlink(chmap *cm, chmapTable *t, void *key, unsigned int hash)
+{
+    chmapEntry *he, **prev;
+
+    prev = &t->entries[hash & t->mask];
+    while ((he = *prev) != NULL) {
+        if (hmapKeycmp(cm, key, hash, he->key, he->hash)) {
+            /* A reader already on `he` still finds its way down the chain */
+            _chmapStore(*prev, he->next);
+            return he;
+        }
+        prev = &he->next;
+    }
+
+    return NULL;
+}
+
+static void
+_chmapFree(void *he, void *type)
+{
+    _chmapEntryFree((hmapType *)type, he);
+}
+
+int
+chmapDelete(chmap *cm, void *key)
+{
+    chmapTable *t;
+    chmapEntry *he, *oldHe = NULL;
+    unsigned int hash;
+
+    hash = hmapHash(cm, key);
+
+    pthread_mutex_lock(&cm->lock);
+    if (cm->table->rehashfrom)
+        _chmapRehash(cm, HM_REHASH_STEP);
+
+    /* It can be in both tables if its bucket has been copied, only one of
+     * them gets to release the key and value */
+    t = cm->table;
+    if (t->rehashfrom)
+        oldHe = _chmapUnlink(cm, t->rehashfrom, key, hash);
+    he = _chmapUnlink(cm, t, key, hash);
+
+    if (he == NULL && oldHe == NULL) {
+        pthread_mutex_unlock(&cm->lock);
+        return HM_NOT_FOUND;
+    }
+    __atomic_store_n(&cm->size, cm->size - 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&cm->lock);
+
+    if (he && oldHe) {
+        epochRetire(oldHe, _chmapFree, cm->type);
+        epochRetire(he, _chmapEntryRelease, cm->type);
+    } else {
+        epochRetire(he ? he : oldHe, _chmapEntryRelease, cm->type);
+    }
+
+    return HM_OK;
+}
+
+unsigned int
+chmapSize(chmap *cm)
+{
+    return __atomic_load_n(&cm->size, __ATOMIC_RELAXED);
+}
+
+static int
+_chmapTableForEach(chmapTable *t, int (*fn)(void *, void *, void *), void *p)
+{
+    chmapEntry *he;
+
+    for (unsigned int i = 0; i < t->capacity; ++i)
+        for (he = _chmapLoad(t->entries[i]); he; he = _chmapLoad(he->next))
+            if (fn(he->key, he->value, p) == HM_ERR)
+                return HM_ERR;
+
+    return HM_OK;
+}
+
+int
+chmapForEach(chmap *cm, int (*fn)(void *key, void *value, void *p), void *p)
+{
+    chmapTable *t, *old;
+
+    t = _chmapLoad(cm->table);
+    if ((old = _chmapLoad(t->rehashfrom)) != NULL)
+        if (_chmapTableForEach(old, fn, p) == HM_ERR)
+            return HM_ERR;
+
+    return _chmapTableForEach(t, fn, p);
+}
@@ -0,0 +1,63 @@
+#ifndef __CHMAP_H__
+#define __CHMAP_H__
+
+#include <pthread.h>
+
+#include "hmap.h"
+
+/* A concurrent hmap. Readers take no locks and never wait on a writer,
+ * writers are serialised by a mutex. Unlinked entries and replaced tables
+ * are released through epoch.h once no reader can still see them */
+
+typedef struct chmapEntry {
+    void *key;
+    void *value;
+    unsigned int hash;
+    struct chmapEntry *next;
+} chmapEntry;
+
+/* While growing the new table points at the one it is replacing. Buckets
+ * below `rehashidx` have been copied across, the old table is left intact
+ * so readers can keep using it and is retired once everything is copied */
+typedef struct chmapTable {
+    unsigned int capacity;
+    unsigned int mask;
+    chmapEntry **entries;
+    struct chmapTable *rehashfrom;
+    unsigned int rehashidx;
+} chmapTable;
+
+typedef struct chmap {
+    chmapTable *table; /* swapped when growing starts */
+    unsigned int size;
+    unsigned int rebuildThreashold;
+    hmapType *type;
+    pthread_mutex_t lock;
+} chmap;
+
+chmap *chmapCreate(hmapType *type);
+/* See hmapCreateWithCapacity */
+chmap *chmapCreateWithCapacity(hmapType *type, unsigned int expected);
+/* Nothing may be reading the map any more */
+void chmapRelease(chmap *cm);
+
+/* Must be called between epochEnter and epochExit, the returned value stays
+ * valid until epochExit */
+void *chmapGet(chmap *cm, void *key);
+
+int chmapAdd(chmap *cm, void *key, void *value);
+/* See hmapAddUnique */
+int chmapAddUnique(chmap *cm, void *key, void *value);
+/* The key and value are released through the type once readers are done */
+int chmapDelete(chmap *cm, void *key);
+unsigned int chmapSize(chmap *cm);
+/* Must be called between epochEnter and epochExit. Sees the map as a
+ * reader would, an entry can come up twice while the map is growing.
+ * Stops at the first HM_ERR from `fn` and returns it */
+int chmapForEach(chmap *cm, int (*fn)(void *key, void *value, void *p),
+        void *p);
+/* Same as hmapRehash and hmapRehashMilliseconds */
+int chmapRehash(chmap *cm, int n);
+int chmapRehashMilliseconds(chmap *cm, int ms);
+
+#endif
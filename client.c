@@ -1,12 +1,13 @@
 #include <errno.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
 #include "inet.h"
 #include "panic.h"
+#include "proto.h"
 
-#define MAX_MSG     1024
 #define PORT        5050
 #define SERVER_NAME "dictionary_daemon"
 
@@ -15,37 +16,150 @@ static char *progname;
 static void
 clientUsage(void)
 {
-    panic("Usage: %s <string>\n"
-          "Print dictionary definition of a word\n",
-            progname);
+    panic("Usage: %s <string> [string ...]\n"
+          "       %s -s [string]\n"
+          "       %s -b\n"
+          "Print dictionary definition of one or more words, or with -s the\n"
+          "server's cache statistics or what it knows about one word. -b\n"
+          "has the server write a snapshot in the background\n",
+            progname, progname, progname);
 }
 
 static int
-clientFindDefinition(char *word)
+clientReadFull(int sockfd, char *buf, size_t len)
 {
+    ssize_t rbytes;
+    size_t total = 0;
+
+    while (total < len) {
+        if ((rbytes = read(sockfd, buf + total, len - total)) <= 0)
+            return 0;
+        total += rbytes;
+    }
+
+    return 1;
+}
+
+static char *
+clientReadReply(int sockfd, protoResponse *res)
+{
+    unsigned char header[PROTO_RES_HEADER_LEN];
+    char *body;
+
+    if (!clientReadFull(sockfd, (char *)header, sizeof(header)))
+        return NULL;
+
+    if (protoDecodeResponseHeader(header, res) != PROTO_OK)
+        return NULL;
+
+    if ((body = malloc(res->len + 1)) == NULL)
+        return NULL;
+
+    if (!clientReadFull(sockfd, body, res->len)) {
+        free(body);
+        return NULL;
+    }
+    body[res->len] = '\0';
+
+    return body;
+}
+
+/* All of the words go out in one write and the server answers them in order
+ * on the same connection */
+static int
+clientFindDefinitions(char **words, int count)
+{
+    int sockfd, retval;
+    unsigned char *msg;
+    char *reply;
+    size_t msglen, len, wordlen;
+    protoResponse res;
+
+    msglen = 0;
+    for (int i = 0; i < count; ++i) {
+        if (strlen(words[i]) > PROTO_MAX_KEYLEN)
+            panic("Word '%s' is too long\n", words[i]);
+        msglen += PROTO_REQ_HEADER_LEN + strlen(words[i]);
+    }
+
+    if ((msg = malloc(msglen)) == NULL)
+        panic("Failed to allocate request\n");
+
+    len = 0;
+    for (int i = 0; i < count; ++i) {
+        wordlen = strlen(words[i]);
+        protoEncodeRequestHeader(msg + len, PROTO_OP_DEFINE, 0, wordlen);
+        memcpy(msg + len + PROTO_REQ_HEADER_LEN, words[i], wordlen);
+        len += PROTO_REQ_HEADER_LEN + wordlen;
+    }
+
+    if ((sockfd = inetConnect(NULL, PORT, 0)) == INET_ERR)
+        panic("Failed to create unix socket %s\n", strerror(errno));
+
+    if (write(sockfd, msg, len) != (ssize_t)len) {
+        close(sockfd);
+        panic("Failed to write to server %s\n", strerror(errno));
+    }
+    free(msg);
+
+    retval = 1;
+    for (int i = 0; i < count; ++i) {
+        if ((reply = clientReadReply(sockfd, &res)) == NULL) {
+            warning("CLIENT ERROR: Failed to read reply %s\n",
+                    strerror(errno));
+            retval = 0;
+            break;
+        }
+        if (count > 1)
+            printf("%s:\n", words[i]);
+        if (res.status == PROTO_STATUS_OK)
+            printf("%s\n", reply);
+        else
+            printf("Failed to find word\n");
+        free(reply);
+    }
+
+    close(sockfd);
+    return retval;
+}
+
+/* Requests that are answered with text to print as is */
+static int
+clientCommand(int opcode, char *word)
+{
+    unsigned char msg[PROTO_REQ_HEADER_LEN + PROTO_MAX_KEYLEN];
+    char *reply;
+    size_t wordlen, len;
+    protoResponse res;
     int sockfd;
-    char buf[BUFSIZ], msg[BUFSIZ];
-    int len, rbytes;
 
-    len = strlen(word);
-    len = snprintf(msg, MAX_MSG, "%s:%d", word, len);
-    msg[len] = '\0';
+    wordlen = word ? strlen(word) : 0;
+    if (wordlen > PROTO_MAX_KEYLEN)
+        panic("Word '%s' is too long\n", word);
+
+    protoEncodeRequestHeader(msg, opcode, 0, wordlen);
+    if (wordlen)
+        memcpy(msg + PROTO_REQ_HEADER_LEN, word, wordlen);
+    len = PROTO_REQ_HEADER_LEN + wordlen;
 
     if ((sockfd = inetConnect(NULL, PORT, 0)) == INET_ERR)
         panic("Failed to create unix socket %s\n", strerror(errno));
 
-    if (write(sockfd, msg, len) <= 0) {
+    if (write(sockfd, msg, len) != (ssize_t)len) {
         close(sockfd);
         panic("Failed to write to server %s\n", strerror(errno));
     }
 
-    if ((rbytes = read(sockfd, buf, BUFSIZ)) < 0) {
+    if ((reply = clientReadReply(sockfd, &res)) == NULL) {
         warning("CLIENT ERROR: Failed to read reply %s\n", strerror(errno));
+        close(sockfd);
+        return 0;
     }
-    buf[rbytes] = '\0';
-    printf("%s\n", buf);
 
-    return 1;
+    printf("%s", reply);
+    free(reply);
+    close(sockfd);
+    return res.status == PROTO_STATUS_OK;
 }
 
 int
@@ -54,10 +168,24 @@ main(int argc, char **argv)
     int retval;
     progname = argv[0];
 
-    if (argc != 2)
+    if (argc < 2)
         clientUsage();
 
-    retval = clientFindDefinition(argv[1]);
+    if (!strcmp(argv[1], "-s")) {
+        if (argc > 3)
+            clientUsage();
+        retval = clientCommand(PROTO_OP_STATS, argc == 3 ? argv[2] : NULL);
+        return retval == 1 ? 0 : 1;
+    }
+
+    if (!strcmp(argv[1], "-b")) {
+        if (argc > 2)
+            clientUsage();
+        retval = clientCommand(PROTO_OP_SAVE, NULL);
+        return retval == 1 ? 0 : 1;
+    }
+
+    retval = clientFindDefinitions(argv + 1, argc - 1);
 
     return retval == 1 ? 0 : 1;
 }
@@ -1,6 +1,7 @@
 #include <sqlite3.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "dbclient.h"
 
@@ -18,48 +19,234 @@ void
 dbRelease(dbClient *client)
 {
     sqlite3 *db = client->conn;
+    dbStmt *stmt, *next;
+
+    for (stmt = client->stmts; stmt; stmt = next) {
+        next = stmt->next;
+        free(stmt->sql);
+        dbStmtRelease(stmt);
+    }
+
     sqlite3_close(db);
     free(client);
 }
 
-void
+/* column_text has to copy a value that is sitting in a page to terminate
+ * it, the blob is the bytes as they are. Asking for the type takes the
+ * connection's mutex, it is only needed to tell an empty value from NULL */
+static void
+_dbColumnRead(sqlite3_stmt *res, int idx, dbColumn *col)
+{
+    col->ptr = sqlite3_column_blob(res, idx);
+    col->len = sqlite3_column_bytes(res, idx);
+    if (col->ptr == NULL && sqlite3_column_type(res, idx) != SQLITE_NULL)
+        col->ptr = "";
+}
+
+int
 dbForEachRow(dbClient *client, char *stmt, void *p,
-        void (*func)(void *, int count, char **data))
+        int (*func)(void *, int count, dbColumn *row))
 {
     sqlite3 *db = client->conn;
-    int columncount, i;
-    sqlite3_stmt *res;
-    char **tuple;
+    int columncount, i, rc, retval;
+    sqlite3_stmt *res = NULL;
+    dbColumn *row = NULL;
 
-    tuple = 0;
+    retval = DB_ERR;
     if (sqlite3_prepare_v2(db, stmt, -1, &res, 0) != SQLITE_OK)
         goto cleanup;
 
-    if (sqlite3_step(res) != SQLITE_ROW)
+    if ((rc = sqlite3_step(res)) != SQLITE_ROW) {
+        if (rc == SQLITE_DONE)
+            retval = DB_OK;
         goto cleanup;
+    }
 
     if ((columncount = sqlite3_column_count(res)) == 0)
         goto cleanup;
 
-    if ((tuple = malloc(sizeof(char *) * columncount)) == NULL)
+    if ((row = malloc(sizeof(dbColumn) * columncount)) == NULL)
         goto cleanup;
 
-    // first row
-    for (i = 0; i < columncount; ++i)
-        tuple[i] = (char *)sqlite3_column_text(res, i);
-    func(p, columncount, tuple);
-
-    while (sqlite3_step(res) == SQLITE_ROW) {
+    do {
         for (i = 0; i < columncount; ++i)
-            tuple[i] = (char *)sqlite3_column_text(res, i);
-        func(p, columncount, tuple);
-    }
+            _dbColumnRead(res, i, &row[i]);
+        if (func(p, columncount, row) == DB_ERR)
+            goto cleanup;
+    } while ((rc = sqlite3_step(res)) == SQLITE_ROW);
+
+    if (rc == SQLITE_DONE)
+        retval = DB_OK;
 
 cleanup:
     if (res)
         sqlite3_finalize(res);
-    if (tuple)
-        free(tuple);
+    free(row);
+    return retval;
+}
+
+dbStmt *
+dbPrepare(dbClient *client, char *sql)
+{
+    sqlite3_stmt *res;
+    dbStmt *stmt;
+
+    if ((stmt = malloc(sizeof(dbStmt))) == NULL)
+        return NULL;
+
+    if (sqlite3_prepare_v3(client->conn, sql, -1, SQLITE_PREPARE_PERSISTENT,
+                &res, NULL) != SQLITE_OK) {
+        free(stmt);
+        return NULL;
+    }
+
+    stmt->client = client;
+    stmt->stmt = res;
+    stmt->sql = NULL;
+    stmt->next = NULL;
+    return stmt;
+}
+
+void
+dbStmtRelease(dbStmt *stmt)
+{
+    if (stmt) {
+        sqlite3_finalize(stmt->stmt);
+        free(stmt);
+    }
+}
+
+/* A connection only ever has a handful, most callers pass the same
+ * string literal every time so the pointer usually matches first */
+dbStmt *
+dbStmtGet(dbClient *client, char *sql)
+{
+    dbStmt *stmt;
+
+    for (stmt = client->stmts; stmt; stmt = stmt->next)
+        if (stmt->sql == sql || !strcmp(stmt->sql, sql))
+            return stmt;
+
+    if ((stmt = dbPrepare(client, sql)) == NULL)
+        return NULL;
+
+    if ((stmt->sql = strdup(sql)) == NULL) {
+        dbStmtRelease(stmt);
+        return NULL;
+    }
+
+    stmt->next = client->stmts;
+    client->stmts = stmt;
+    return stmt;
+}
+
+char *
+dbStmtQueryText(dbStmt *stmt, char *param, int paramlen, int *len)
+{
+    const char *text;
+    char *copy = NULL;
+    int textlen;
+
+    if (dbStmtBindText(stmt, 1, param, paramlen) == DB_ERR)
+        goto cleanup;
+
+    if (dbStmtStep(stmt) != DB_ROW)
+        goto cleanup;
+
+    if ((text = dbStmtColumnText(stmt, 0, &textlen)) == NULL)
+        goto cleanup;
+
+    if ((copy = malloc(textlen + 1)) == NULL)
+        goto cleanup;
+
+    memcpy(copy, text, textlen);
+    copy[textlen] = '\0';
+    *len = textlen;
+
+cleanup:
+    /* Ready for the next call, `param` is not referenced after this */
+    dbStmtReset(stmt);
+    return copy;
+}
+
+int
+dbStmtBindText(dbStmt *stmt, int idx, char *text, int len)
+{
+    if (sqlite3_bind_text(stmt->stmt, idx, text, len, SQLITE_STATIC) !=
+            SQLITE_OK)
+        return DB_ERR;
+    return DB_OK;
+}
+
+int
+dbStmtBindBlob(dbStmt *stmt, int idx, void *data, int len)
+{
+    if (sqlite3_bind_blob(stmt->stmt, idx, data, len, SQLITE_STATIC) !=
+            SQLITE_OK)
+        return DB_ERR;
+    return DB_OK;
+}
+
+int
+dbStmtBindInt(dbStmt *stmt, int idx, long long value)
+{
+    if (sqlite3_bind_int64(stmt->stmt, idx, value) != SQLITE_OK)
+        return DB_ERR;
+    return DB_OK;
+}
+
+int
+dbStmtStep(dbStmt *stmt)
+{
+    switch (sqlite3_step(stmt->stmt)) {
+    case SQLITE_ROW:
+        return DB_ROW;
+    case SQLITE_DONE:
+        return DB_OK;
+    default:
+        return DB_ERR;
+    }
+}
+
+/* The length has to be asked for after the text, it is of whatever the
+ * column was last converted to */
+const char *
+dbStmtColumnText(dbStmt *stmt, int idx, int *len)
+{
+    const char *text;
+
+    text = (const char *)sqlite3_column_text(stmt->stmt, idx);
+    *len = sqlite3_column_bytes(stmt->stmt, idx);
+    return text;
+}
+
+long long
+dbStmtColumnInt(dbStmt *stmt, int idx)
+{
+    return sqlite3_column_int64(stmt->stmt, idx);
+}
+
+void
+dbStmtReset(dbStmt *stmt)
+{
+    sqlite3_reset(stmt->stmt);
+    sqlite3_clear_bindings(stmt->stmt);
+}
+
+long long
+dbQueryInt(dbClient *client, char *stmt)
+{
+    sqlite3_stmt *res;
+    long long value = 0;
+
+    if (sqlite3_prepare_v2(client->conn, stmt, -1, &res, 0) != SQLITE_OK)
+        return 0;
+
+    if (sqlite3_step(res) == SQLITE_ROW)
+        value = sqlite3_column_int64(res, 0);
+
+    sqlite3_finalize(res);
+    return value;
 }
 
 /* The stmt has to follow SELECT COUNT .... otherwise this will fail */
@@ -105,8 +292,13 @@ dbExec(dbClient *client, char *sql)
 dbClient *
 dbConnect(char *dbname)
 {
+    char pragmas[4][64] = {
+        "PRAGMA journal_mode=WAL;",
+        "PRAGMA synchronous=NORMAL;",
+    };
     sqlite3 *db;
     dbClient *c;
+    int i, len;
 
     if ((c = malloc(sizeof(dbClient))) == NULL)
         return NULL;
@@ -116,6 +308,25 @@ dbConnect(char *dbname)
         return NULL;
     }
 
+    /* Other connections can be reading the table, wait for them rather
+     * than failing a write */
+    sqlite3_busy_timeout(db, DB_BUSY_TIMEOUT_MS);
+
+    /* WAL lets lookups and the loaders read while a batch is written and
+     * with it NORMAL only syncs at a checkpoint, a power cut can lose the
+     * last commits but not corrupt the file. Each is tried on its own, a
+     * connection without them still works */
+    len = snprintf(pragmas[2], sizeof(pragmas[2]), "PRAGMA mmap_size=%lld;",
+            DB_MMAP_SIZE);
+    pragmas[2][len] = '\0';
+    len = snprintf(pragmas[3], sizeof(pragmas[3]), "PRAGMA cache_size=-%d;",
+            DB_CACHE_KB);
+    pragmas[3][len] = '\0';
+
+    for (i = 0; i < 4; ++i)
+        sqlite3_exec(db, pragmas[i], noop, NULL, NULL);
+
     c->conn = db;
+    c->stmts = NULL;
     return c;
 }
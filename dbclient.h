@@ -3,9 +3,33 @@
 
 #define DB_ERR 0
 #define DB_OK  1
+#define DB_ROW 2 /* dbStmtStep has a row ready */
+
+#define DB_BUSY_TIMEOUT_MS 5000
+/* Applied to every connection by dbConnect */
+#define DB_MMAP_SIZE (256LL << 20) /* reads come straight from the page cache */
+#define DB_CACHE_KB  16384         /* sqlite's own page cache */
+
+/* A column as it is stored, nothing is converted, copied or terminated.
+ * `ptr` is NULL for a NULL column and can point into sqlite's pages, it is
+ * only valid until the row callback returns. Numbers are their text */
+typedef struct dbColumn {
+    const char *ptr;
+    int len;
+} dbColumn;
+
+/* A statement compiled once and run many times. Only one thread may use a
+ * statement at a time */
+typedef struct dbStmt {
+    struct dbClient *client;
+    void *stmt;
+    char *sql; /* only for those cached on the connection */
+    struct dbStmt *next;
+} dbStmt;
 
 typedef struct dbClient {
     void *conn;
+    dbStmt *stmts; /* see dbStmtGet */
 } dbClient;
 
 dbClient *dbConnect(char *dbname);
@@ -13,7 +37,33 @@ void dbRelease(dbClient *client);
 
 long long dbGetRowCount(dbClient *client, char *stmt);
 int dbExec(dbClient *client, char *sql);
-void dbForEachRow(dbClient *client, char *stmt, void *p,
-        void (*func)(void *, int count, char **data));
+/* Stops early if `func` returns DB_ERR, DB_OK only if every row was seen.
+ * `row` is reused for every row */
+int dbForEachRow(dbClient *client, char *stmt, void *p,
+        int (*func)(void *, int count, dbColumn *row));
+/* The first column of the first row, 0 if there is none */
+long long dbQueryInt(dbClient *client, char *stmt);
+
+dbStmt *dbPrepare(dbClient *client, char *sql);
+void dbStmtRelease(dbStmt *stmt);
+/* Compiled the first time `sql` is asked for on this connection, the same
+ * statement after that. It belongs to the connection and is released with
+ * it, it must be reset after use */
+dbStmt *dbStmtGet(dbClient *client, char *sql);
+/* Binds `param` to the statement's only parameter and returns a malloced
+ * copy of the first column of the first row, NULL if there is none */
+char *dbStmtQueryText(dbStmt *stmt, char *param, int paramlen, int *len);
+/* Parameters are numbered from 1. Text is not copied, it has to stay valid
+ * until the statement is reset */
+int dbStmtBindText(dbStmt *stmt, int idx, char *text, int len);
+int dbStmtBindBlob(dbStmt *stmt, int idx, void *data, int len);
+int dbStmtBindInt(dbStmt *stmt, int idx, long long value);
+/* DB_ROW, DB_OK once there are no more rows or DB_ERR */
+int dbStmtStep(dbStmt *stmt);
+/* Columns of the current row, numbered from 0. Text is valid until the
+ * next step or reset, NULL for a NULL column */
+const char *dbStmtColumnText(dbStmt *stmt, int idx, int *len);
+long long dbStmtColumnInt(dbStmt *stmt, int idx);
+void dbStmtReset(dbStmt *stmt);
 
 #endif
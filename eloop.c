@@ -1,5 +1,6 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <time.h>
 
 #include "eloop.h"
 
@@ -22,10 +23,26 @@ _eloopSetEvtAdd(evt *evs, int eventcount)
         evs[i].mask = EVT_ADD;
 }
 
+#define EVT_TIMER_DELETED -1
+
+static long long
+_eloopNowMs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
 void
 eloopRelease(eloop *el)
 {
     if (el) {
+        evtTimer *timer, *next;
+
+        for (timer = el->timers; timer != NULL; timer = next) {
+            next = timer->next;
+            free(timer);
+        }
         free(el->idle);
         free(el->active);
         eloopStateRelease(el);
@@ -57,6 +74,8 @@ eloopCreate(int eventcount)
 
     el->max = -1;
     el->count = eventcount;
+    el->timerid = 0;
+    el->timers = NULL;
     el->idle = idle;
     el->active = active;
     _eloopSetEvtAdd(el->idle, el->count);
@@ -122,16 +141,112 @@ eloopDeleteEvent(eloop *el, int fd, int mask)
     }
 }
 
+long long
+eloopAddTimer(eloop *el, long long ms, evtTimerCallback *cb, void *data)
+{
+    evtTimer *timer;
+
+    if ((timer = malloc(sizeof(evtTimer))) == NULL)
+        return EVT_TIMER_DELETED;
+
+    timer->id = el->timerid++;
+    timer->when = _eloopNowMs() + ms;
+    timer->cb = cb;
+    timer->data = data;
+    timer->next = el->timers;
+    el->timers = timer;
+
+    return timer->id;
+}
+
+/* Only marks the timer, it is unlinked after the next round of timers so
+ * it is safe to call from inside a timer callback */
+void
+eloopDeleteTimer(eloop *el, long long id)
+{
+    for (evtTimer *timer = el->timers; timer != NULL; timer = timer->next) {
+        if (timer->id == id) {
+            timer->id = EVT_TIMER_DELETED;
+            return;
+        }
+    }
+}
+
+/* Milliseconds until the nearest timer is due, -1 to block forever */
+static int
+_eloopPollTimeout(eloop *el)
+{
+    long long nearest = -1, now, wait;
+
+    for (evtTimer *timer = el->timers; timer != NULL; timer = timer->next) {
+        if (timer->id == EVT_TIMER_DELETED)
+            continue;
+        if (nearest == -1 || timer->when < nearest)
+            nearest = timer->when;
+    }
+
+    if (nearest == -1)
+        return -1;
+
+    now = _eloopNowMs();
+    wait = nearest - now;
+    return wait < 0 ? 0 : (int)wait;
+}
+
+static int
+_eloopProcessTimers(eloop *el)
+{
+    evtTimer *timer, *prev, *next;
+    long long now, maxid, retval;
+    int processed = 0;
+
+    /* Timers created by a callback wait for the next iteration */
+    maxid = el->timerid - 1;
+
+    for (timer = el->timers; timer != NULL; timer = timer->next) {
+        if (timer->id == EVT_TIMER_DELETED || timer->id > maxid)
+            continue;
+
+        now = _eloopNowMs();
+        if (timer->when > now)
+            continue;
+
+        retval = timer->cb(el, timer->id, timer->data);
+        processed++;
+
+        if (retval == EVT_TIMER_NOMORE)
+            timer->id = EVT_TIMER_DELETED;
+        else
+            timer->when = _eloopNowMs() + retval;
+    }
+
+    prev = NULL;
+    for (timer = el->timers; timer != NULL; timer = next) {
+        next = timer->next;
+        if (timer->id == EVT_TIMER_DELETED) {
+            if (prev)
+                prev->next = next;
+            else
+                el->timers = next;
+            free(timer);
+        } else {
+            prev = timer;
+        }
+    }
+
+    return processed;
+}
+
 int
 eloopProcessEvents(eloop *el)
 {
-    if (el->max == -1)
+    if (el->max == -1 && el->timers == NULL)
         return 0;
     int processed, eventcount, fd, mask, firedevts;
     evt *ev;
 
     processed = 0;
-    eventcount = eloopPoll(el);
+    eventcount = eloopPoll(el, _eloopPollTimeout(el));
 
     for (int i = 0; i < eventcount; ++i) {
         fd = el->active[i].fd;
@@ -155,6 +270,8 @@ eloopProcessEvents(eloop *el)
         processed++;
     }
 
+    processed += _eloopProcessTimers(el);
+
     return processed;
 }
 
@@ -9,9 +9,14 @@
 #define EVT_ERR 0
 #define EVT_OK  1
 
+#define EVT_TIMER_NOMORE -1
+
 struct eloop;
 
 typedef void evtCallback(struct eloop *el, int fd, void *data, int type);
+/* Return the number of milliseconds until the timer should fire again or
+ * EVT_TIMER_NOMORE to delete it */
+typedef long long evtTimerCallback(struct eloop *el, long long id, void *data);
 
 typedef struct evt {
     int fd;
@@ -21,11 +26,21 @@ typedef struct evt {
     void *data;
 } evt;
 
+typedef struct evtTimer {
+    long long id;
+    long long when; /* monotonic milliseconds */
+    evtTimerCallback *cb;
+    void *data;
+    struct evtTimer *next;
+} evtTimer;
+
 typedef struct eloop {
     int max;
     int count;
+    long long timerid;
     evt *idle;
     evt *active;
+    evtTimer *timers;
     void *state;
 } eloop;
 
@@ -34,6 +49,9 @@ typedef struct eloop {
 eloop *eloopCreate(int eventcount);
 int eloopAddEvent(eloop *el, int fd, int mask, evtCallback *cb, void *data);
 void eloopDeleteEvent(eloop *el, int fd, int mask);
+long long eloopAddTimer(eloop *el, long long ms, evtTimerCallback *cb,
+        void *data);
+void eloopDeleteTimer(eloop *el, long long id);
 void eloopMain(eloop *el);
 
 #endif
@@ -0,0 +1,188 @@
+/* Epoch based reclamation
+ *
+ * The global epoch only moves forward once every thread inside a section has
+ * seen the current value. Something retired at epoch `e` was unreachable
+ * before the epoch became `e + 1`, so by `e + 2` nobody can be holding it */
+#include <pthread.h>
+#include <stdlib.h>
+
+#include "epoch.h"
+#include "panic.h"
+
+/* How many retirements to collect before trying to reclaim */
+#define EPOCH_RECLAIM_BATCH 64
+
+#define _epochActive(state) ((state)&1UL)
+#define _epochOf(state)     ((state) >> 1)
+
+typedef struct epochSlot {
+    unsigned long state; /* epoch << 1 | active */
+    int depth;
+    int inuse;
+    struct epochSlot *next;
+} epochSlot;
+
+typedef struct epochRetired {
+    void *ptr;
+    epochReleaseFn *release;
+    void *ctx;
+    unsigned long epoch;
+    struct epochRetired *next;
+} epochRetired;
+
+static pthread_mutex_t epochlock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned long globalepoch = 0;
+static epochSlot *slots = NULL;
+static epochRetired *retired = NULL;
+static int retiredcount = 0;
+static _Thread_local epochSlot *threadslot = NULL;
+
+static epochSlot *
+_epochSlotAcquire(void)
+{
+    epochSlot *slot;
+
+    pthread_mutex_lock(&epochlock);
+    for (slot = slots; slot; slot = slot->next)
+        if (!slot->inuse)
+            break;
+
+    if (slot == NULL) {
+        if ((slot = calloc(1, sizeof(epochSlot))) == NULL)
+            panic("EPOCH ERROR: Failed to allocate thread slot\n");
+        slot->next = slots;
+        slots = slot;
+    }
+    slot->inuse = 1;
+    slot->depth = 0;
+    __atomic_store_n(&slot->state, 0, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&epochlock);
+
+    return slot;
+}
+
+void
+epochEnter(void)
+{
+    unsigned long e;
+
+    if (threadslot == NULL)
+        threadslot = _epochSlotAcquire();
+
+    if (threadslot->depth++ > 0)
+        return;
+
+    /* The epoch may move on between reading and publishing it, go again
+     * until what is published is current */
+    do {
+        e = __atomic_load_n(&globalepoch, __ATOMIC_ACQUIRE);
+        __atomic_store_n(&threadslot->state, e << 1 | 1, __ATOMIC_SEQ_CST);
+    } while (__atomic_load_n(&globalepoch, __ATOMIC_SEQ_CST) != e);
+}
+
+void
+epochExit(void)
+{
+    if (--threadslot->depth > 0)
+        return;
+
+    __atomic_store_n(&threadslot->state, 0, __ATOMIC_RELEASE);
+}
+
+void
+epochThreadRelease(void)
+{
+    if (threadslot == NULL)
+        return;
+
+    pthread_mutex_lock(&epochlock);
+    threadslot->inuse = 0;
+    pthread_mutex_unlock(&epochlock);
+    threadslot = NULL;
+}
+
+/* Must hold the lock. Moves the epoch forward if every reader is up to date
+ * and hands back everything retired two or more epochs ago */
+static epochRetired *
+_epochCollect(void)
+{
+    epochRetired *ready, **prev, *cur;
+    unsigned long e, state;
+
+    e = __atomic_load_n(&globalepoch, __ATOMIC_RELAXED);
+    for (epochSlot *slot = slots; slot; slot = slot->next) {
+        state = __atomic_load_n(&slot->state, __ATOMIC_SEQ_CST);
+        if (_epochActive(state) && _epochOf(state) != e)
+            goto collect;
+    }
+    __atomic_store_n(&globalepoch, ++e, __ATOMIC_SEQ_CST);
+
+collect:
+    ready = NULL;
+    prev = &retired;
+    while ((cur = *prev) != NULL) {
+        if (cur->epoch + 2 <= e) {
+            *prev = cur->next;
+            cur->next = ready;
+            ready = cur;
+            retiredcount--;
+        } else {
+            prev = &cur->next;
+        }
+    }
+
+    return ready;
+}
+
+static void
+_epochReleaseAll(epochRetired *ready)
+{
+    epochRetired *next;
+
+    while (ready) {
+        next = ready->next;
+        ready->release(ready->ptr, ready->ctx);
+        free(ready);
+        ready = next;
+    }
+}
+
+int
+epochRetire(void *ptr, epochReleaseFn *release, void *ctx)
+{
+    epochRetired *r, *ready = NULL;
+
+    if ((r = malloc(sizeof(epochRetired))) == NULL)
+        return EPOCH_ERR;
+
+    r->ptr = ptr;
+    r->release = release;
+    r->ctx = ctx;
+
+    pthread_mutex_lock(&epochlock);
+    r->epoch = __atomic_load_n(&globalepoch, __ATOMIC_RELAXED);
+    r->next = retired;
+    retired = r;
+    if (++retiredcount >= EPOCH_RECLAIM_BATCH)
+        ready = _epochCollect();
+    pthread_mutex_unlock(&epochlock);
+
+    /* Outside of the lock, releasing can be slow */
+    _epochReleaseAll(ready);
+    return EPOCH_OK;
+}
+
+int
+epochReclaim(void)
+{
+    epochRetired *ready;
+    int remaining;
+
+    pthread_mutex_lock(&epochlock);
+    ready = _epochCollect();
+    remaining = retiredcount;
+    pthread_mutex_unlock(&epochlock);
+
+    _epochReleaseAll(ready);
+    return remaining;
+}
@@ -0,0 +1,24 @@
+#ifndef __EPOCH_H__
+#define __EPOCH_H__
+
+#define EPOCH_ERR 0
+#define EPOCH_OK  1
+
+/* Called once no reader can still be looking at `ptr` */
+typedef void epochReleaseFn(void *ptr, void *ctx);
+
+/* Readers bracket every access to shared memory with epochEnter and
+ * epochExit, anything retired in the meantime is kept alive until they have
+ * left. Sections may nest and are cheap enough to take per request */
+void epochEnter(void);
+void epochExit(void);
+
+/* Defer releasing `ptr` until every reader that could have seen it has
+ * exited its section */
+int epochRetire(void *ptr, epochReleaseFn *release, void *ctx);
+/* Frees whatever is safe to free now, returns how much is still waiting */
+int epochReclaim(void);
+/* Gives the calling thread's slot back, it must not be in a section */
+void epochThreadRelease(void);
+
+#endif
@@ -95,24 +95,23 @@ eloopStateDelete(eloop *el, int fd, int mask)
 
     newmask = el->idle[fd].mask & (~mask);
     event.events = 0;
-    newmask |= el->idle[fd].mask;
     event.data.fd = fd;
 
     _eloopStateSetMask(&event, newmask);
 
-    if (newmask != EVT_DELETE)
-        epoll_ctl(es->efd, EPOLL_CTL_ADD, fd, &event);
+    if (newmask != EVT_ADD)
+        epoll_ctl(es->efd, EPOLL_CTL_MOD, fd, &event);
     else
         epoll_ctl(es->efd, EPOLL_CTL_DEL, fd, &event);
 }
 
 static int
-eloopPoll(eloop *el)
+eloopPoll(eloop *el, int timeoutms)
 {
     evtState *es = eloopGetState(el);
     int fdcount;
 
-    fdcount = epoll_wait(es->efd, es->events, el->count, -1);
+    fdcount = epoll_wait(es->efd, es->events, el->count, timeoutms);
 
     if (fdcount > 0) {
         for (int i = 0; i < fdcount; ++i) {
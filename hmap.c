@@ -1,33 +1,168 @@
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
 
+#include "aostr.h"
 #include "hmap.h"
 
 #define _hmapShouldRebuild(h) \
     ((h)->size >= (h)->rebuildThreashold && (h)->fixedsize == 0)
 
 static inline hmapEntry **
-hmapEntryAlloc(unsigned int capacity)
+_hmapBucketsAlloc(unsigned int capacity)
 {
     return calloc(capacity, sizeof(hmapEntry *));
 }
 
-static inline unsigned int
-hashString(void *key)
+/* wyhash, seeded once per process so chains can not be flooded with words
+ * crafted to collide */
+static const uint64_t _hmapSecret[4] = {0xa0761d6478bd642fULL,
+        0xe7037ed1a0b428dbULL, 0x8ebc6af09c88c6e3ULL, 0x589965cc75374cc3ULL};
+static uint64_t hmapSeed = 0;
+static pthread_once_t hmapSeedOnce = PTHREAD_ONCE_INIT;
+
+static void
+_hmapSeedInit(void)
 {
-    char *s = key;
-    unsigned int h = (unsigned int)*s;
+    uint64_t seed = 0;
+    int fd;
 
-    if (h) {
-        for (++s; *s; ++s)
-            h = (h << 5) - h + (unsigned int)*s;
+    if ((fd = open("/dev/urandom", O_RDONLY)) != -1) {
+        if (read(fd, &seed, sizeof(seed)) != sizeof(seed))
+            seed = 0;
+        close(fd);
     }
 
-    return h;
+    if (seed == 0)
+        seed = (uint64_t)time(NULL) ^ ((uint64_t)getpid() << 32) ^
+                (uint64_t)(uintptr_t)&seed;
+    hmapSeed = seed;
+}
+
+void
+hmapInitSeed(void)
+{
+    pthread_once(&hmapSeedOnce, _hmapSeedInit);
+}
+
+static inline void
+_hmapMum(uint64_t *a, uint64_t *b)
+{
+#if defined(__SIZEOF_INT128__)
+    __extension__ typedef unsigned __int128 u128;
+    u128 r = (u128)*a * *b;
+    *a = (uint64_t)r;
+    *b = (uint64_t)(r >> 64);
+#else
+    uint64_t ha = *a >> 32, hb = *b >> 32, la = (uint32_t)*a,
+             lb = (uint32_t)*b, hi, lo;
+    uint64_t rh = ha * hb, rm0 = ha * lb, rm1 = hb * la, rl = la * lb,
+             t = rl + (rm0 << 32), c = t < rl;
+    lo = t + (rm1 << 32);
+    c += lo < t;
+    hi = rh + (rm0 >> 32) + (rm1 >> 32) + c;
+    *a = lo;
+    *b = hi;
+#endif
 }
 
-static inline int
+static inline uint64_t
+_hmapMix(uint64_t a, uint64_t b)
+{
+    _hmapMum(&a, &b);
+    return a ^ b;
+}
+
+static inline uint64_t
+_hmapRead8(const uint8_t *p)
+{
+    uint64_t v;
+    memcpy(&v, p, 8);
+    return v;
+}
+
+static inline uint64_t
+_hmapRead4(const uint8_t *p)
+{
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+uint64_t
+hmapHashBytesSeeded(const void *data, size_t len, uint64_t seed)
+{
+    const uint8_t *p = data;
+    const uint64_t *s = _hmapSecret;
+    uint64_t a, b, see1, see2;
+    size_t i;
+
+    seed ^= _hmapMix(seed ^ s[0], s[1]);
+
+    if (len <= 16) {
+        if (len >= 4) {
+            a = (_hmapRead4(p) << 32) | _hmapRead4(p + ((len >> 3) << 2));
+            b = (_hmapRead4(p + len - 4) << 32) |
+                    _hmapRead4(p + len - 4 - ((len >> 3) << 2));
+        } else if (len > 0) {
+            a = ((uint64_t)p[0] << 16) | ((uint64_t)p[len >> 1] << 8) |
+                    p[len - 1];
+            b = 0;
+        } else {
+            a = b = 0;
+        }
+    } else {
+        i = len;
+        if (i > 48) {
+            see1 = see2 = seed;
+            do {
+                seed = _hmapMix(_hmapRead8(p) ^ s[1], _hmapRead8(p + 8) ^ seed);
+                see1 = _hmapMix(_hmapRead8(p + 16) ^ s[2],
+                        _hmapRead8(p + 24) ^ see1);
+                see2 = _hmapMix(_hmapRead8(p + 32) ^ s[3],
+                        _hmapRead8(p + 40) ^ see2);
+                p += 48;
+                i -= 48;
+            } while (i > 48);
+            seed ^= see1 ^ see2;
+        }
+        while (i > 16) {
+            seed = _hmapMix(_hmapRead8(p) ^ s[1], _hmapRead8(p + 8) ^ seed);
+            i -= 16;
+            p += 16;
+        }
+        a = _hmapRead8(p + i - 16);
+        b = _hmapRead8(p + i - 8);
+    }
+
+    a ^= s[1];
+    b ^= seed;
+    _hmapMum(&a, &b);
+    return _hmapMix(a ^ s[0] ^ len, b ^ s[1]);
+}
+
+uint64_t
+hmapHashBytes(const void *data, size_t len)
+{
+    return hmapHashBytesSeeded(data, len, hmapSeed);
+}
+
+#define _hmapFold(h) ((unsigned int)((h) ^ ((h) >> 32)))
+
+unsigned int
+hmapHashString(void *key)
+{
+    char *s = key;
+    uint64_t h = hmapHashBytes(s, strlen(s));
+    return _hmapFold(h);
+}
+
+int
 hmapStrCmp(void *k1, unsigned int h1, void *k2, unsigned int h2)
 {
     char *str1 = k1;
@@ -36,6 +171,26 @@ hmapStrCmp(void *k1, unsigned int h1, void *k2, unsigned int h2)
     return h1 == h2 && strcmp(str1, str2) == 0;
 }
 
+/* aoStr keys carry their length, hashing does not have to look for the end
+ * and keys of different lengths are told apart without reading them */
+unsigned int
+hmapHashAoStr(void *key)
+{
+    aoStr *s = key;
+    uint64_t h = hmapHashBytes(s->data, s->len);
+    return _hmapFold(h);
+}
+
+int
+hmapAoStrCmp(void *k1, unsigned int h1, void *k2, unsigned int h2)
+{
+    aoStr *s1 = k1;
+    aoStr *s2 = k2;
+
+    return h1 == h2 && s1->len == s2->len &&
+            memcmp(s1->data, s2->data, s1->len) == 0;
+}
+
 static unsigned int
 roundup32bit(unsigned int num)
 {
@@ -54,44 +209,46 @@ _hmapEntryRelease(hmap *hm, hmapEntry *he, int freeHe)
 {
     if (he) {
         if (freeHe) {
-            hmapKeyRelease(hm, he->key);
-            hmapValueRelease(hm, he->value);
-            free(he);
+            if (hm->type->freekey)
+                hmapKeyRelease(hm, he->key);
+            if (hm->type->freevalue)
+                hmapValueRelease(hm, he->value);
+            hmapEntryFree(hm, he);
         }
     }
 }
 
 hmapType defaultType = {
-    .hashFn = hashString,
+    .hashFn = hmapHashString,
     .keycmp = hmapStrCmp,
     .freekey = free,
     .freevalue = free,
 };
 
-void
-hmapRelease(hmap *hm)
+static void
+_hmapEntriesRelease(hmap *hm, hmapEntry **entries, unsigned int capacity)
 {
-    hmapEntry *he, *next, *cur;
+    hmapEntry *he, *next;
 
-    for (unsigned int i = 0; i < hm->size; ++i) {
-        if ((he = hm->entries[i]) != NULL) {
-            if (he->next != NULL) {
-                cur = he->next;
-
-                while (cur) {
-                    next = cur->next;
-                    _hmapEntryRelease(hm, cur, 1);
-                    cur = next;
-                }
-            }
+    for (unsigned int i = 0; i < capacity; ++i) {
+        for (he = entries[i]; he; he = next) {
+            next = he->next;
             _hmapEntryRelease(hm, he, 1);
         }
     }
+    free(entries);
+}
+
+void
+hmapRelease(hmap *hm)
+{
+    _hmapEntriesRelease(hm, hm->entries, hm->capacity);
+    if (hmapIsRehashing(hm))
+        _hmapEntriesRelease(hm, hm->oldentries, hm->oldcapacity);
 
     hm->size = 0;
     hm->mask = 0;
     hm->rebuildThreashold = 0;
-    free(hm->entries);
     free(hm);
 }
 
@@ -103,7 +260,8 @@ _hmapCreate(hmapType *type, int fixedsize, unsigned int startCapacity)
     if ((hm = malloc(sizeof(hmap))) == NULL)
         return NULL;
 
-    if ((hm->entries = hmapEntryAlloc(HM_MIN_CAPACITY)) == NULL) {
+    hmapInitSeed();
+    if ((hm->entries = _hmapBucketsAlloc(startCapacity)) == NULL) {
         free(hm);
         return NULL;
     }
@@ -114,6 +272,10 @@ _hmapCreate(hmapType *type, int fixedsize, unsigned int startCapacity)
     hm->mask = hm->capacity - 1;
     hm->rebuildThreashold = ~~((unsigned int)(HM_LOAD * hm->capacity));
     hm->fixedsize = fixedsize;
+    hm->oldentries = NULL;
+    hm->oldcapacity = 0;
+    hm->oldmask = 0;
+    hm->rehashidx = -1;
 
     return hm;
 }
@@ -136,69 +298,124 @@ hmapCreateFixed(hmapType *type, unsigned int capacity)
     return _hmapCreate(type, 1, roundup32bit(capacity));
 }
 
+/* Enough buckets that `expected` entries stay under the load factor */
+unsigned int
+hmapCapacityFor(unsigned int expected)
+{
+    unsigned int capacity = roundup32bit((unsigned int)(expected / HM_LOAD) + 1);
+    return capacity < (HM_MIN_CAPACITY) ? (HM_MIN_CAPACITY) : capacity;
+}
+
+hmap *
+hmapCreateWithCapacity(hmapType *type, unsigned int expected)
+{
+    return _hmapCreate(type, 0, hmapCapacityFor(expected));
+}
+
+/* Only allocates the new table, the entries are moved over a few buckets at
+ * a time by hmapRehash so no single call pays for all of them */
 static int
 _hmapExpand(hmap *hm)
 {
-    unsigned int i;
-    int idx;
-    hmapEntry **newEntries, **oldEntries;
-    unsigned int newCapacity, newMask, newRebuildThreashold, size;
-
-    size = hm->size;
+    hmapEntry **newEntries;
+    unsigned int newCapacity;
 
     newCapacity = hm->capacity << 1;
-    newMask = newCapacity - 1;
-    newRebuildThreashold = ~~((unsigned int)(HM_LOAD * newCapacity));
-
-    newEntries = hmapEntryAlloc(newCapacity);
-    if (newEntries == NULL)
+    if ((newEntries = _hmapBucketsAlloc(newCapacity)) == NULL)
         return HM_ERR;
 
-    for (i = 0; i < hm->capacity && size > 0; ++i) {
-        hmapEntry *he, *nextHe;
+    hm->oldentries = hm->entries;
+    hm->oldcapacity = hm->capacity;
+    hm->oldmask = hm->mask;
+    hm->rehashidx = 0;
+
+    hm->entries = newEntries;
+    hm->capacity = newCapacity;
+    hm->mask = newCapacity - 1;
+    hm->rebuildThreashold = ~~((unsigned int)(HM_LOAD * newCapacity));
+    return HM_OK;
+}
+
+int
+hmapRehash(hmap *hm, int n)
+{
+    hmapEntry *he, *nextHe;
+    unsigned int idx;
+    /* Long runs of empty buckets count too, but for less */
+    int emptyvisits = n * 10;
 
-        if (hm->entries[i] == NULL)
-            continue;
+    if (!hmapIsRehashing(hm))
+        return 0;
+
+    while (n-- && hm->rehashidx < (long)hm->oldcapacity) {
+        while (hm->oldentries[hm->rehashidx] == NULL) {
+            hm->rehashidx++;
+            if (hm->rehashidx == (long)hm->oldcapacity || --emptyvisits == 0)
+                goto done;
+        }
 
-        he = hm->entries[i];
+        he = hm->oldentries[hm->rehashidx];
         while (he) {
-            idx = he->hash & newMask;
             nextHe = he->next;
-            he->next = newEntries[idx];
-            newEntries[idx] = he;
-            size--;
+            idx = he->hash & hm->mask;
+            he->next = hm->entries[idx];
+            hm->entries[idx] = he;
             he = nextHe;
         }
+        hm->oldentries[hm->rehashidx] = NULL;
+        hm->rehashidx++;
     }
 
-    oldEntries = hm->entries;
-    hm->entries = newEntries;
-    hm->mask = newMask;
-    hm->capacity = newCapacity;
-    hm->rebuildThreashold = newRebuildThreashold;
-    free(oldEntries);
-    return HM_OK;
+done:
+    if (hm->rehashidx == (long)hm->oldcapacity) {
+        free(hm->oldentries);
+        hm->oldentries = NULL;
+        hm->oldcapacity = 0;
+        hm->oldmask = 0;
+        hm->rehashidx = -1;
+        return 0;
+    }
+
+    return 1;
 }
 
-static int
-_hmapGetIndex(hmap *hm, void *key, unsigned int hash)
+static long long
+_hmapTimeMs(void)
 {
-    hmapEntry *he;
-    int idx;
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
 
-    if (_hmapShouldRebuild(hm))
-        _hmapExpand(hm);
+int
+hmapRehashMilliseconds(hmap *hm, int ms)
+{
+    long long start = _hmapTimeMs();
+    int rehashes = 0;
 
-    idx = hash & hm->mask;
-    he = hm->entries[idx];
+    while (hmapRehash(hm, 100)) {
+        rehashes += 100;
+        if (_hmapTimeMs() - start > ms)
+            break;
+    }
 
-    while (he) {
-        if (hmapKeycmp(hm, key, hash, he->key, he->hash))
-            return HM_FOUND;
-        he = he->next;
+    return rehashes;
+}
+
+/* An entry is in the old table for as long as its bucket there has not been
+ * moved, so there is only ever one chain to look in */
+static hmapEntry **
+_hmapBucket(hmap *hm, unsigned int hash)
+{
+    unsigned int idx;
+
+    if (hmapIsRehashing(hm)) {
+        idx = hash & hm->oldmask;
+        if ((long)idx >= hm->rehashidx)
+            return &hm->oldentries[idx];
     }
 
-    return idx;
+    return &hm->entries[hash & hm->mask];
 }
 
 hmapEntry *
@@ -208,7 +425,7 @@ hmapGetEntry(hmap *hm, void *key)
     unsigned int hash;
 
     hash = hmapHash(hm, key);
-    he = hm->entries[hash & hm->mask];
+    he = *_hmapBucket(hm, hash);
 
     while (he) {
         if (hmapKeycmp(hm, key, hash, he->key, he->hash))
@@ -233,66 +450,94 @@ hmapGet(hmap *hm, void *key)
 int
 hmapContains(hmap *hm, void *key)
 {
-    unsigned int hash = hmapHash(hm, key);
-    if (_hmapGetIndex(hm, key, hash) == HM_FOUND)
+    if (hmapGetEntry(hm, key) != NULL)
         return HM_FOUND;
     return HM_NOT_FOUND;
 }
 
-int
-hmapAdd(hmap *hm, void *key, void *value)
+static int
+_hmapInsert(hmap *hm, void *key, void *value, unsigned int hash)
 {
-    int idx;
-    unsigned int hash;
-    hmapEntry *newHe;
-
-    hash = hmapHash(hm, key);
-
-    if ((idx = _hmapGetIndex(hm, key, hash)) == HM_FOUND)
-        return HM_FOUND;
+    hmapEntry *newHe, **bucket;
 
-    if ((newHe = malloc(sizeof(hmapEntry))) == NULL)
+    if ((newHe = hmapEntryAlloc(hm, sizeof(hmapEntry))) == NULL)
         return HM_ERR;
 
-    newHe->next = hm->entries[idx];
+    bucket = _hmapBucket(hm, hash);
+    newHe->next = *bucket;
     newHe->key = key;
     newHe->value = value;
     newHe->hash = hash;
-    hm->entries[idx] = newHe;
+    *bucket = newHe;
     hm->size++;
 
     return HM_OK;
 }
 
+static void
+_hmapGrow(hmap *hm)
+{
+    if (hmapIsRehashing(hm))
+        hmapRehash(hm, HM_REHASH_STEP);
+    else if (_hmapShouldRebuild(hm))
+        _hmapExpand(hm);
+}
+
+int
+hmapAdd(hmap *hm, void *key, void *value)
+{
+    hmapEntry *he;
+    unsigned int hash;
+
+    _hmapGrow(hm);
+
+    hash = hmapHash(hm, key);
+    for (he = *_hmapBucket(hm, hash); he; he = he->next)
+        if (hmapKeycmp(hm, key, hash, he->key, he->hash))
+            return HM_FOUND;
+
+    return _hmapInsert(hm, key, value, hash);
+}
+
+int
+hmapAddUnique(hmap *hm, void *key, void *value)
+{
+    _hmapGrow(hm);
+    return _hmapInsert(hm, key, value, hmapHash(hm, key));
+}
+
 hmapEntry *
 hmapDelete(hmap *hm, void *key)
 {
-    unsigned int hash, idx;
-    hmapEntry *he, *heprev;
+    unsigned int hash;
+    hmapEntry *he, **prev;
+
+    if (hmapIsRehashing(hm))
+        hmapRehash(hm, HM_REHASH_STEP);
 
-    heprev = NULL;
     hash = hmapHash(hm, key);
-    idx = hash & hm->mask;
-    he = hm->entries[idx];
+    prev = _hmapBucket(hm, hash);
 
-    while (he) {
+    while ((he = *prev) != NULL) {
         if (hmapKeycmp(hm, key, hash, he->key, he->hash)) {
-            if (heprev)
-                heprev->next = he->next;
-            else
-                hm->entries[idx] = he->next;
+            *prev = he->next;
             hm->size--;
-
             return he;
-        } else {
-            heprev = he;
-            he = he->next;
         }
+        prev = &he->next;
     }
 
     return NULL;
 }
 
+size_t
+hmapMemoryUsage(hmap *hm)
+{
+    return sizeof(hmap) +
+            (size_t)(hm->capacity + hm->oldcapacity) * sizeof(hmapEntry *) +
+            (size_t)hm->size * sizeof(hmapEntry);
+}
+
 hmapIterator *
 hmapIteratorCreate(hmap *hm)
 {
@@ -315,25 +560,29 @@ hmapIteratorRelease(hmapIterator *iter)
         free(iter);
 }
 
+/* Walks the old table's buckets first then the new one's */
 int
 hmapIteratorGetNext(hmapIterator *iter)
 {
+    hmap *hm = iter->hm;
+    hmapEntry *he;
     unsigned int idx;
 
-    while (iter->idx < iter->hm->capacity) {
-        if (iter->cur == NULL || iter->cur->next == NULL) {
-            idx = iter->idx;
-            iter->idx++;
-
-            if (iter->hm->entries[idx] != NULL) {
-                iter->cur = iter->hm->entries[idx];
-                return HM_OK;
-            }
-        } else if (iter->cur->next != NULL) {
-            iter->cur = iter->cur->next;
+    if (iter->cur != NULL && iter->cur->next != NULL) {
+        iter->cur = iter->cur->next;
+        return HM_OK;
+    }
+
+    while (iter->idx < hm->oldcapacity + hm->capacity) {
+        idx = iter->idx++;
+        if (idx < hm->oldcapacity)
+            he = hm->oldentries[idx];
+        else
+            he = hm->entries[idx - hm->oldcapacity];
+
+        if (he != NULL) {
+            iter->cur = he;
             return HM_OK;
-        } else {
-            return HM_ERR;
         }
     }
 
@@ -1,12 +1,18 @@
 #ifndef __HMAP_H__
 #define __HMAP_H__
 
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+
 #define HM_MIN_CAPACITY 1 << 16
 #define HM_LOAD         0.67
 #define HM_ERR          0
 #define HM_OK           1
 #define HM_FOUND        -2
 #define HM_NOT_FOUND    -3
+/* Buckets moved to the new table by each add or delete while rehashing */
+#define HM_REHASH_STEP 1
 
 typedef int hmapKeyCompare(void *, unsigned int h1, void *, unsigned int h2);
 
@@ -15,6 +21,9 @@ typedef struct hmapType {
     unsigned int (*hashFn)(void *);
     void (*freekey)(void *);
     void (*freevalue)(void *);
+    /* Where entries come from, malloc and free when not set */
+    void *(*allocentry)(size_t size);
+    void (*freeentry)(void *entry);
 } hmapType;
 
 typedef struct hmapEntry {
@@ -24,6 +33,8 @@ typedef struct hmapEntry {
     struct hmapEntry *next;
 } hmapEntry;
 
+/* While growing both tables exist, `entries` is the new one and buckets of
+ * `oldentries` below `rehashidx` have already been moved into it */
 typedef struct hmap {
     unsigned int size;
     unsigned int capacity;
@@ -32,6 +43,10 @@ typedef struct hmap {
     int fixedsize;
     hmapType *type;
     hmapEntry **entries;
+    hmapEntry **oldentries;
+    unsigned int oldcapacity;
+    unsigned int oldmask;
+    long rehashidx; /* -1 when not rehashing */
 } hmap;
 
 typedef struct hmapIterator {
@@ -40,23 +55,57 @@ typedef struct hmapIterator {
     hmapEntry *cur;
 } hmapIterator;
 
+#define hmapIsRehashing(hm) ((hm)->rehashidx != -1)
 #define hmapHash(h, k) ((h->type)->hashFn((k)))
 #define hmapKeycmp(hm, k1, h1, k2, h2) \
     ((hm)->type->keycmp((k1), (h1), (k2), (h2)))
 #define hmapKeyRelease(hm, k)   ((hm)->type->freekey((k)))
 #define hmapValueRelease(hm, k) ((hm)->type->freevalue((k)))
+#define hmapEntryAlloc(hm, size)                                     \
+    ((hm)->type->allocentry ? (hm)->type->allocentry((size)) : \
+                              malloc((size)))
+#define hmapEntryFree(hm, he)                                        \
+    ((hm)->type->freeentry ? (hm)->type->freeentry((he)) : free((he)))
+
+/* Seeded from /dev/urandom the first time a table is created, called again
+ * it does nothing */
+void hmapInitSeed(void);
+uint64_t hmapHashBytes(const void *data, size_t len);
+/* For hashes that have to be the same in another process, such as ones
+ * written to disk */
+uint64_t hmapHashBytesSeeded(const void *data, size_t len, uint64_t seed);
+
+/* The string hashing and comparison the default type uses */
+unsigned int hmapHashString(void *key);
+int hmapStrCmp(void *k1, unsigned int h1, void *k2, unsigned int h2);
+/* For aoStr keys, which know their length */
+unsigned int hmapHashAoStr(void *key);
+int hmapAoStrCmp(void *k1, unsigned int h1, void *k2, unsigned int h2);
 
 hmap *hmapCreate();
 hmap *hmapCreateWithType(hmapType *type);
 hmap *hmapCreateFixed(hmapType *type, unsigned int capacity);
+/* Presized for a bulk load of `expected` entries, it still grows if needed */
+hmap *hmapCreateWithCapacity(hmapType *type, unsigned int expected);
+unsigned int hmapCapacityFor(unsigned int expected);
 void hmapRelease(hmap *hm);
 
 int hmapContains(hmap *hm, void *key);
 int hmapAdd(hmap *hm, void *key, void *value);
-/* Return entry for user to free */
+/* Skips looking for the key first, only for sources that can not have
+ * duplicates */
+int hmapAddUnique(hmap *hm, void *key, void *value);
+/* Return entry for user to free with hmapEntryFree */
 hmapEntry *hmapDelete(hmap *hm, void *key);
 hmapEntry *hmapGetEntry(hmap *hm, void *key);
 void *hmapGet(hmap *hm, void *key);
+/* Moves up to `n` buckets to the new table, returns 1 if there is more to
+ * move. hmapRehashMilliseconds does the same for roughly `ms` and is meant
+ * for when the caller is otherwise idle */
+int hmapRehash(hmap *hm, int n);
+int hmapRehashMilliseconds(hmap *hm, int ms);
+/* Bytes held by the table itself, not counting keys and values */
+size_t hmapMemoryUsage(hmap *hm);
 
 hmapIterator *hmapIteratorCreate(hmap *hm);
 void hmapIteratorRelease(hmapIterator *iter);
@@ -87,14 +87,22 @@ sortstring(void *str1, void *str2)
     unsigned int len2 = aoStrLen(pp2);
     unsigned int minlen = len1 > len2 ? len2 : len1;
 
-    return memcmp(pp1, pp2, minlen);
+    return memcmp(pp1->data, pp2->data, minlen);
+}
+
+/* Must be called once from the main thread before any other thread parses */
+void
+htmlInit(void)
+{
+    xmlInitParser();
 }
 
 list *
 htmlGetMatches(aoStr *html, char *classname)
 {
     list *l = parse_html(html, classname);
-    listQSort(l, sortstring);
+    if (l)
+        listQSort(l, sortstring);
     return l;
 }
 
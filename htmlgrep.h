@@ -4,6 +4,7 @@
 #include "aostr.h"
 #include "list.h"
 
+void htmlInit(void);
 list *htmlGetMatches(aoStr *html, char *classname);
 aoStr *htmlConcatList(list *l);
 
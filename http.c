@@ -3,9 +3,29 @@
 #include <string.h>
 
 #include "aostr.h"
+#include "eloop.h"
 #include "http.h"
 #include "panic.h"
 
+#define HTTP_USER_AGENT "libcurl-agent/1.0"
+#define HTTP_TIMEOUT    15L
+
+/* One in flight request on a httpMulti */
+typedef struct httpTransfer {
+    CURL *curl;
+    aoStr *body;
+    httpCallback *cb;
+    void *data;
+} httpTransfer;
+
+/* Must be called once from the main thread before any other thread uses
+ * curl */
+void
+httpInit(void)
+{
+    curl_global_init(CURL_GLOBAL_DEFAULT);
+}
+
 httpResponse *
 _httpCreateResponse()
 {
@@ -34,6 +54,8 @@ httpResponseRelease(httpResponse *response)
 static int
 _httpGetContentType(char *type)
 {
+    if (type == NULL)
+        return RES_TYPE_INVALID;
     if (strncmp(type, "application/json", 16) == 0)
         return RES_TYPE_JSON;
     if (strncmp(type, "text/html", 9) == 0)
@@ -125,3 +147,200 @@ curlHttpGet(char *url)
 
     return httpres;
 }
+
+static void
+_httpMultiCheckDone(httpMulti *hm)
+{
+    CURLMsg *msg;
+    CURL *curl;
+    httpTransfer *transfer;
+    httpResponse *httpres;
+    char *contenttype;
+    long statuscode;
+    int pending;
+
+    while ((msg = curl_multi_info_read(hm->multi, &pending)) != NULL) {
+        if (msg->msg != CURLMSG_DONE)
+            continue;
+
+        curl = msg->easy_handle;
+        curl_easy_getinfo(curl, CURLINFO_PRIVATE, (char **)&transfer);
+        httpres = NULL;
+
+        if (msg->data.result != CURLE_OK) {
+            warning("Failed to make request: %s\n",
+                    curl_easy_strerror(msg->data.result));
+        } else if ((httpres = _httpCreateResponse()) != NULL) {
+            contenttype = NULL;
+            statuscode = 0;
+            curl_easy_getinfo(curl, CURLINFO_CONTENT_TYPE, &contenttype);
+            curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &statuscode);
+            httpres->status_code = statuscode;
+            httpres->content_type = _httpGetContentType(contenttype);
+            httpres->body = transfer->body;
+            httpres->bodylen = transfer->body->len;
+            transfer->body = NULL;
+        }
+
+        curl_multi_remove_handle(hm->multi, curl);
+        curl_easy_cleanup(curl);
+        aoStrRelease(transfer->body);
+        transfer->cb(httpres, transfer->data);
+        free(transfer);
+    }
+}
+
+static void
+_httpMultiSocketEvent(eloop *el, int fd, void *data, int mask)
+{
+    (void)el;
+    httpMulti *hm = data;
+    int flags = 0;
+
+    if (mask & EVT_READ)
+        flags |= CURL_CSELECT_IN;
+    if (mask & EVT_WRITE)
+        flags |= CURL_CSELECT_OUT;
+
+    curl_multi_socket_action(hm->multi, fd, flags, &hm->running);
+    _httpMultiCheckDone(hm);
+}
+
+/* curl tells us which events it wants on each of its sockets */
+static int
+_httpMultiSocketCallback(CURL *curl, curl_socket_t sockfd, int what,
+        void *userp, void *socketp)
+{
+    (void)curl;
+    (void)socketp;
+    httpMulti *hm = userp;
+
+    switch (what) {
+    case CURL_POLL_IN:
+        eloopDeleteEvent(hm->el, sockfd, EVT_WRITE);
+        eloopAddEvent(hm->el, sockfd, EVT_READ, _httpMultiSocketEvent, hm);
+        break;
+    case CURL_POLL_OUT:
+        eloopDeleteEvent(hm->el, sockfd, EVT_READ);
+        eloopAddEvent(hm->el, sockfd, EVT_WRITE, _httpMultiSocketEvent, hm);
+        break;
+    case CURL_POLL_INOUT:
+        eloopAddEvent(hm->el, sockfd, EVT_READ | EVT_WRITE,
+                _httpMultiSocketEvent, hm);
+        break;
+    case CURL_POLL_REMOVE:
+        eloopDeleteEvent(hm->el, sockfd, EVT_READ | EVT_WRITE);
+        break;
+    }
+
+    return 0;
+}
+
+static long long
+_httpMultiTimeout(eloop *el, long long id, void *data)
+{
+    (void)el;
+    (void)id;
+    httpMulti *hm = data;
+
+    hm->timerid = -1;
+    curl_multi_socket_action(hm->multi, CURL_SOCKET_TIMEOUT, 0, &hm->running);
+    _httpMultiCheckDone(hm);
+
+    return EVT_TIMER_NOMORE;
+}
+
+/* curl only ever wants one timer, a new timeout replaces the old one */
+static int
+_httpMultiTimerCallback(CURLM *multi, long timeoutms, void *userp)
+{
+    (void)multi;
+    httpMulti *hm = userp;
+
+    if (hm->timerid != -1) {
+        eloopDeleteTimer(hm->el, hm->timerid);
+        hm->timerid = -1;
+    }
+
+    if (timeoutms >= 0)
+        hm->timerid = eloopAddTimer(hm->el, timeoutms, _httpMultiTimeout, hm);
+
+    return 0;
+}
+
+httpMulti *
+httpMultiCreate(eloop *el)
+{
+    httpMulti *hm;
+    CURLM *multi;
+
+    if ((hm = malloc(sizeof(httpMulti))) == NULL)
+        return NULL;
+
+    if ((multi = curl_multi_init()) == NULL) {
+        free(hm);
+        return NULL;
+    }
+
+    hm->multi = multi;
+    hm->el = el;
+    hm->timerid = -1;
+    hm->running = 0;
+
+    curl_multi_setopt(multi, CURLMOPT_SOCKETFUNCTION, _httpMultiSocketCallback);
+    curl_multi_setopt(multi, CURLMOPT_SOCKETDATA, hm);
+    curl_multi_setopt(multi, CURLMOPT_TIMERFUNCTION, _httpMultiTimerCallback);
+    curl_multi_setopt(multi, CURLMOPT_TIMERDATA, hm);
+
+    return hm;
+}
+
+void
+httpMultiRelease(httpMulti *hm)
+{
+    if (hm) {
+        if (hm->timerid != -1)
+            eloopDeleteTimer(hm->el, hm->timerid);
+        curl_multi_cleanup(hm->multi);
+        free(hm);
+    }
+}
+
+/* Starts the request and returns straight away, `cb` is called from the
+ * eventloop once the transfer has finished */
+int
+httpMultiGet(httpMulti *hm, char *url, httpCallback *cb, void *data)
+{
+    httpTransfer *transfer;
+    CURL *curl;
+
+    if ((curl = curl_easy_init()) == NULL)
+        return HTTP_ERR;
+
+    if ((transfer = malloc(sizeof(httpTransfer))) == NULL) {
+        curl_easy_cleanup(curl);
+        return HTTP_ERR;
+    }
+
+    transfer->curl = curl;
+    transfer->body = aoStrAlloc(512);
+    transfer->cb = cb;
+    transfer->data = data;
+
+    curl_easy_setopt(curl, CURLOPT_URL, url);
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, &httpRequestWriteCallback);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &transfer->body);
+    curl_easy_setopt(curl, CURLOPT_USERAGENT, HTTP_USER_AGENT);
+    curl_easy_setopt(curl, CURLOPT_PRIVATE, transfer);
+    curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+    curl_easy_setopt(curl, CURLOPT_TIMEOUT, HTTP_TIMEOUT);
+
+    if (curl_multi_add_handle(hm->multi, curl) != CURLM_OK) {
+        aoStrRelease(transfer->body);
+        curl_easy_cleanup(curl);
+        free(transfer);
+        return HTTP_ERR;
+    }
+
+    return HTTP_OK;
+}
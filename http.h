@@ -2,6 +2,7 @@
 #define __HTTP__
 
 #include "aostr.h"
+#include "eloop.h"
 
 #define RES_TYPE_INVALID (0 << 1)
 #define RES_TYPE_HTML    (1 << 1)
@@ -18,10 +19,28 @@ typedef struct httpResponse {
     int content_type;
 } httpResponse;
 
+/* Called on the eventloop thread, the callback owns the response which is
+ * NULL if the transfer failed */
+typedef void httpCallback(httpResponse *response, void *data);
+
+/* Non-blocking http client driven by an eventloop through curl's multi
+ * socket interface */
+typedef struct httpMulti {
+    void *multi;
+    eloop *el;
+    long long timerid;
+    int running;
+} httpMulti;
+
+void httpInit(void);
 void httpResponseRelease(httpResponse *response);
 void httpPrintResponse(httpResponse *response);
 
 httpResponse *httpMakeGetRequest(char *url, char *additional_headers);
 httpResponse *curlHttpGet(char *url);
 
+httpMulti *httpMultiCreate(eloop *el);
+void httpMultiRelease(httpMulti *hm);
+int httpMultiGet(httpMulti *hm, char *url, httpCallback *cb, void *data);
+
 #endif
@@ -27,6 +27,22 @@ inetSetSocketReuseAddr(int sockfd)
     return INET_OK;
 }
 
+/* Lets several listeners bind the same port, the kernel balances incoming
+ * connections between them */
+int
+inetSetSocketReusePort(int sockfd)
+{
+    int yes = 1;
+
+    if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(int)) ==
+            -1) {
+        warning("INET ERROR: Failed to set REUSEPORT: %s\n", strerror(errno));
+        return INET_ERR;
+    }
+
+    return INET_OK;
+}
+
 int
 inetSetSocketNonBlocking(int sockfd)
 {
@@ -202,6 +218,10 @@ _inetCreateServer(int port, char *bindaddr, int addrfam, int backlog, int flags)
         if (inetSetSocketReuseAddr(sockfd) == INET_ERR)
             return inetCleanupAfterFailure(sockfd, servinfo);
 
+        if (flags & INET_REUSE_PORT)
+            if (inetSetSocketReusePort(sockfd) == INET_ERR)
+                return inetCleanupAfterFailure(sockfd, servinfo);
+
         if (bind(sockfd, ptr->ai_addr, ptr->ai_addrlen) == -1)
             return inetCleanupAfterFailure(sockfd, servinfo);
 
@@ -237,12 +257,19 @@ inetCreateServerNonBlocking(int port, char *bindaddr, int backlog)
             INET_NON_BLOCK);
 }
 
+int
+inetCreateServerReusePort(int port, char *bindaddr, int backlog)
+{
+    return _inetCreateServer(port, bindaddr, AF_UNSPEC, backlog,
+            INET_NON_BLOCK | INET_REUSE_PORT);
+}
+
 int
 _inetAccept(int sockfd, int nonBlocking)
 {
     int acceptedfd;
     struct sockaddr_storage in_addr;
-    socklen_t socklen;
+    socklen_t socklen = sizeof(in_addr);
 
     if ((acceptedfd = accept(sockfd, (struct sockaddr *)&in_addr, &socklen)) ==
             -1)
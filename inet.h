@@ -5,6 +5,7 @@
 #define INET_OK  1
 
 #define INET_NON_BLOCK 1
+#define INET_REUSE_PORT 2
 
 int inetSetSocketReuseAddr(int sockfd);
 int inetCreateUnixServerSocket(char *name, int backlog);
@@ -15,5 +16,6 @@ int inetAcceptBlocking(int sockfd);
 int inetAcceptNonBlocking(int sockfd);
 int inetCreateServerBlocking(int port, char *bindaddr, int backlog);
 int inetCreateServerNonBlocking(int port, char *bindaddr, int backlog);
+int inetCreateServerReusePort(int port, char *bindaddr, int backlog);
 
 #endif
@@ -97,12 +97,20 @@ eloopStateDelete(eloop *el, int fd, int mask)
 }
 
 static int
-eloopPoll(eloop *el)
+eloopPoll(eloop *el, int timeoutms)
 {
     evtState *es = eloopGetState(el);
+    struct timespec timeout, *tsp;
     int fdcount;
 
-    fdcount = kevent(es->kfd, NULL, 0, es->events, el->count, NULL);
+    tsp = NULL;
+    if (timeoutms >= 0) {
+        timeout.tv_sec = timeoutms / 1000;
+        timeout.tv_nsec = (timeoutms % 1000) * 1000000;
+        tsp = &timeout;
+    }
+
+    fdcount = kevent(es->kfd, NULL, 0, es->events, el->count, tsp);
 
     if (fdcount > 0) {
         for (int i = 0; i < fdcount; ++i) {
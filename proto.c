@@ -0,0 +1,96 @@
+#include <stddef.h>
+
+#include "proto.h"
+
+static inline void
+_protoPutU16(unsigned char *buf, unsigned int num)
+{
+    buf[0] = (num >> 8) & 0xFF;
+    buf[1] = num & 0xFF;
+}
+
+static inline void
+_protoPutU32(unsigned char *buf, unsigned int num)
+{
+    buf[0] = (num >> 24) & 0xFF;
+    buf[1] = (num >> 16) & 0xFF;
+    buf[2] = (num >> 8) & 0xFF;
+    buf[3] = num & 0xFF;
+}
+
+static inline unsigned int
+_protoGetU16(const unsigned char *buf)
+{
+    return ((unsigned int)buf[0] << 8) | (unsigned int)buf[1];
+}
+
+static inline unsigned int
+_protoGetU32(const unsigned char *buf)
+{
+    return ((unsigned int)buf[0] << 24) | ((unsigned int)buf[1] << 16) |
+            ((unsigned int)buf[2] << 8) | (unsigned int)buf[3];
+}
+
+/* `buf` must have room for PROTO_REQ_HEADER_LEN bytes, the key follows */
+void
+protoEncodeRequestHeader(unsigned char *buf, int opcode, int flags,
+        unsigned int keylen)
+{
+    buf[0] = PROTO_VERSION;
+    buf[1] = opcode;
+    _protoPutU16(buf + 2, flags);
+    _protoPutU32(buf + 4, keylen);
+}
+
+/* Returns PROTO_INCOMPLETE until a whole frame is in `buf` and PROTO_ERR if
+ * it can never become one */
+int
+protoDecodeRequest(const unsigned char *buf, size_t buflen, protoRequest *req)
+{
+    if (buflen < PROTO_REQ_HEADER_LEN)
+        return PROTO_INCOMPLETE;
+
+    req->version = buf[0];
+    req->opcode = buf[1];
+    req->flags = _protoGetU16(buf + 2);
+    req->keylen = _protoGetU32(buf + 4);
+
+    if (req->version != PROTO_VERSION || req->keylen > PROTO_MAX_KEYLEN)
+        return PROTO_ERR;
+
+    req->framelen = PROTO_REQ_HEADER_LEN + req->keylen;
+    if (buflen < req->framelen)
+        return PROTO_INCOMPLETE;
+
+    req->key = (const char *)buf + PROTO_REQ_HEADER_LEN;
+
+    return PROTO_OK;
+}
+
+/* `buf` must have room for PROTO_RES_HEADER_LEN bytes, the body follows */
+void
+protoEncodeResponseHeader(unsigned char *buf, int opcode, int status,
+        int flags, unsigned int len)
+{
+    buf[0] = PROTO_VERSION;
+    buf[1] = opcode;
+    buf[2] = status;
+    buf[3] = flags;
+    _protoPutU32(buf + 4, len);
+}
+
+/* `buf` holds at least PROTO_RES_HEADER_LEN bytes */
+int
+protoDecodeResponseHeader(const unsigned char *buf, protoResponse *res)
+{
+    res->version = buf[0];
+    res->opcode = buf[1];
+    res->status = buf[2];
+    res->flags = buf[3];
+    res->len = _protoGetU32(buf + 4);
+
+    if (res->version != PROTO_VERSION)
+        return PROTO_ERR;
+
+    return PROTO_OK;
+}
@@ -0,0 +1,56 @@
+#ifndef __PROTO_H__
+#define __PROTO_H__
+
+#include <stddef.h>
+
+/* Wire format, all integers are big endian.
+ *
+ * request:  | version u8 | opcode u8 | flags u16 | keylen u32 | key ... |
+ * response: | version u8 | opcode u8 | status u8 | flags u8 | len u32 |
+ *           | body ... |
+ */
+#define PROTO_VERSION        1
+#define PROTO_REQ_HEADER_LEN 8
+#define PROTO_RES_HEADER_LEN 8
+#define PROTO_MAX_KEYLEN     512
+
+#define PROTO_ERR        0
+#define PROTO_OK         1
+#define PROTO_INCOMPLETE 2
+
+/* Opcodes */
+#define PROTO_OP_DEFINE 1
+#define PROTO_OP_STATS  2 /* with a key, stats for that word */
+#define PROTO_OP_SAVE   3 /* write a snapshot in the background */
+
+/* Response status */
+#define PROTO_STATUS_OK          0
+#define PROTO_STATUS_NOT_FOUND   1
+#define PROTO_STATUS_BAD_REQUEST 2
+
+typedef struct protoRequest {
+    unsigned char version;
+    unsigned char opcode;
+    unsigned int flags;
+    unsigned int keylen;
+    const char *key;  /* points into the buffer that was decoded */
+    size_t framelen;  /* header and key */
+} protoRequest;
+
+typedef struct protoResponse {
+    unsigned char version;
+    unsigned char opcode;
+    unsigned char status;
+    unsigned char flags;
+    unsigned int len;
+} protoResponse;
+
+void protoEncodeRequestHeader(unsigned char *buf, int opcode, int flags,
+        unsigned int keylen);
+int protoDecodeRequest(const unsigned char *buf, size_t buflen,
+        protoRequest *req);
+void protoEncodeResponseHeader(unsigned char *buf, int opcode, int status,
+        int flags, unsigned int len);
+int protoDecodeResponseHeader(const unsigned char *buf, protoResponse *res);
+
+#endif
@@ -3,268 +3,2684 @@
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/un.h>
+#include <sys/wait.h>
 
 #include <ctype.h>
 #include <errno.h>
+#include <limits.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
+#include <zdict.h>
+#include <zstd.h>
 
 #include "aostr.h"
+#include "arena.h"
+#include "chmap.h"
 #include "dbclient.h"
 #include "eloop.h"
+#include "epoch.h"
 #include "hmap.h"
 #include "htmlgrep.h"
 #include "http.h"
 #include "inet.h"
 #include "list.h"
 #include "panic.h"
+#include "proto.h"
+#include "slab.h"
+#include "snapshot.h"
+#include "tinylfu.h"
+#include "workpool.h"
 
 #define SERVER_NAME     "dictionary_daemon"
 #define SERVER_ERR      0
 #define SERVER_OK       1
 #define DB_NAME         "dict.db"
 #define DB_TABLE        "dict"
+#define DB_FREQ_TABLE   "dict_freq" /* how often cached words were asked for */
+#define DB_CODEC_TABLE  "dict_codec" /* what definitions are compressed with */
+
+/* Compiled once per connection by dbStmtGet */
+#define SQL_LOOKUP "SELECT definitions FROM " DB_TABLE " WHERE word = ?1;"
+#define SQL_INSERT \
+    "INSERT INTO " DB_TABLE " (word, definitions) VALUES (?1, ?2)" \
+    " ON CONFLICT (word) DO UPDATE SET definitions = excluded.definitions;"
+#define SQL_FREQ_DELETE "DELETE FROM " DB_FREQ_TABLE ";"
+#define SQL_FREQ_INSERT \
+    "INSERT INTO " DB_FREQ_TABLE " (word, hits) VALUES (?1, ?2);"
+#define SQL_CODEC_GET "SELECT dictionary FROM " DB_CODEC_TABLE " WHERE id = 0;"
+#define SQL_CODEC_PUT \
+    "INSERT INTO " DB_CODEC_TABLE " (id, dictionary) VALUES (0, ?1);"
+#define SNAP_NAME       "dict.snap"
 #define MAX_MSG         1024
+#define READ_CHUNK      16384
+#define MAX_READS       16      /* per readable event, so one client can't
+                                   starve the others */
+#define MAX_PENDING     1024    /* replies queued before reads are paused */
+#define MAX_OUTBUF      (4 << 20)
 #define BACKLOG         500
 #define PORT            5050
+#define PARSE_THREADS   4
+#define SERVER_CRON_MS  100
+#define SERVER_FREQ_MS  60000 /* how often DB_FREQ_TABLE is rewritten */
+#define SERVER_SNAPSHOT_MS 300000 /* how often SNAP_NAME is rewritten if the
+                                     table has changed */
+#define SERVER_MIN_ENTRY 256  /* smallest likely entry in bytes, for sizing
+                                 the admission sketch */
+#define SERVER_CLOCK_PEEK 128 /* entries looked at for an admission victim */
+#define LOAD_THREADS    8
+#define LOAD_MIN_ROWS   65536 /* per loader thread */
+#define LOAD_BATCH      4096  /* rows merged into the cache in one go */
+#define PERSIST_BATCH   512   /* new words written in one transaction */
+#define PERSIST_WINDOW_MS 50  /* longest a new word waits to be written */
+#define PERSIST_MAX_ATTEMPTS 100 /* failed writes before a word is dropped */
+#define SERVER_CODEC_SAMPLES 4096 /* definitions compression is trained on */
+#define SERVER_CODEC_MIN     64   /* fewer than this and it is not worth it */
+#define SERVER_CODEC_DICT    (32 * 1024) /* the most the dictionary takes */
+#define SERVER_CODEC_LEVEL   3
 #define MERRIAM_WEBSTER "https://www.merriam-webster.com/dictionary"
 
-typedef struct dictionaryServer {
+/* Each thread owns an eventloop and a SO_REUSEPORT listener, the kernel
+ * spreads connections between them. A connection never leaves the thread
+ * that accepted it */
+typedef struct serverThread {
+    int id;
     int sfd;
-    int maxclients;
     int clientcount;
+    unsigned long long hits; /* only written by this thread */
+    unsigned long long misses;
+    unsigned long long snapshothits; /* included in hits */
+    pthread_t tid;
+    eloop *evtloop;
+    httpMulti *http;
+    workpoolMailbox *mailbox;
+} serverThread;
+
+/* The cache's values. `ref` is set by readers and cleared by the clock hand
+ * as it passes, an entry is evicted if the hand comes round again before
+ * anyone has looked at it */
+typedef struct serverCacheItem {
+    aoStr *key;
+    aoStr *value;
+    size_t bytes; /* everything freed along with it */
+    int ref;
+} serverCacheItem;
+
+typedef struct serverPersistStats {
+    unsigned long long batches;
+    unsigned long long rows;
+    unsigned long long failures;
+    unsigned long long dropped; /* words that could not be written at all */
+    int lastbatch;
+    int maxbatch;
+    long long lastms; /* from the oldest in a batch being queued to commit */
+    long long maxms;
+} serverPersistStats;
+
+typedef struct dictionaryServer {
+    int maxclients;
+    int threadcount;
     pid_t pid;
-    hmap *cache;
+    chmap *cache;
+    slab *entryslab; /* the cache's chmapEntrys */
+    slab *itemslab;  /* and their serverCacheItems */
+    arena *loadarenas[LOAD_THREADS]; /* words and definitions loaded at
+                                        startup, one per loader thread and
+                                        only when nothing is ever evicted */
+    size_t cachebudget; /* bytes, 0 for no limit */
+    size_t cacheused;
+    size_t cachedefinitions; /* bytes of definitions as they are stored */
+    size_t cacheraw;         /* and once decoded */
+    /* Set before any thread starts, NULL without a dictionary */
+    ZSTD_CDict *cdict;
+    ZSTD_DDict *ddict;
+    size_t codecdictlen;
+    int compress; /* new definitions are stored compressed, -z */
+    serverCacheItem **clock; /* every item, in no particular order */
+    unsigned int clocklen;
+    unsigned int clockcap;
+    unsigned int clockhand;
+    pthread_mutex_t cachelock; /* adding and evicting, taken before the
+                                  chmap's own lock */
+    tinylfu *sketch; /* how often words are asked for, only with a budget */
+    int loading;     /* the table is still being read into the cache */
+    pthread_t loader;
+    snapshot *snapshot; /* swapped under an epoch, NULL if there is none */
+    unsigned long long dirty; /* words committed since it was written */
+    int snapshotting; /* a child or a thread is writing one */
+    pthread_mutex_t snapshotlock; /* one writer at a time */
+    pid_t bgsavepid; /* -1 unless a child is writing it */
+    int bgsavefd;    /* the child's serverBgsaveReport */
+    unsigned long long bgsavedirty; /* `dirty` when it was forked */
+    long long bgsavestart;
+    long long bgsaveforkus; /* the last fork() */
+    long long bgsavems;
+    size_t bgsavecow; /* bytes copied on write during the last one */
+    int bgsavestatus;
+    volatile sig_atomic_t shutdown;
+    hmap *inflight;
+    pthread_mutex_t inflightlock;
     dbClient *db;
-    eloop *evtloop;
+    list *persistqueue;   /* serverPersist, oldest first */
+    hmap *persistpending; /* the same by word, until they are committed */
+    int persistscheduled; /* a flush is queued on the db thread */
+    pthread_mutex_t persistlock;
+    pthread_mutex_t persistflushlock; /* one flush at a time */
+    serverPersistStats persiststats;  /* under persistlock */
+    workpool *dbpool;   /* the db thread */
+    workpool *parsepool;
+    serverThread *threads;
 } dictionaryServer;
 
-dictionaryServer server;
+/* A connection, it stays open for as many requests as the client sends */
+typedef struct serverClient {
+    serverThread *thread;
+    int fd;       /* -1 once closed */
+    int pending;  /* replies waiting on a lookup */
+    int mask;     /* events currently registered with the loop */
+    int eof;      /* client has stopped sending, close once replies are out */
+    aoStr *querybuf;
+    aoStr *outbuf; /* `offset` is how much of it has been written */
+    list *replies;
+} serverClient;
+
+/* A slot in a client's reply queue, misses fill theirs in when the lookup
+ * completes */
+typedef struct serverReply {
+    serverClient *c;
+    int ready;
+    aoStr *payload;
+} serverReply;
+
+/* A cache miss waiting on merriam webster and then the parse pool, every
+ * client asking for the same word while it is in flight shares it */
+typedef struct lookupRequest {
+    serverThread *thread; /* the one fetching it */
+    char *word;
+    int wordlen;
+    aoStr key; /* the word again, as the in-flight table's key */
+    list *waiters; /* serverReply */
+    httpResponse *resp;
+    aoStr *definition;
+    int fromdb; /* found in the database, it is already stored */
+} lookupRequest;
+
+/* One per loader thread. Rows are collected and merged into the cache in
+ * batches, so the threads take the cache lock once per batch rather than
+ * for every row */
+typedef struct serverLoader {
+    pthread_t tid;
+    dbClient *db;
+    arena *arena; /* NULL with a budget */
+    long long from; /* rowids, inclusive */
+    long long to;
+    int count;
+    aoStr *keys[LOAD_BATCH];
+    aoStr *values[LOAD_BATCH];
+    char *scratch; /* definitions are compressed into this */
+    size_t scratchcap;
+    int full; /* stopped because the budget has no room left */
+} serverLoader;
+
+/* A new word waiting on the db thread to be written */
+typedef struct serverPersist {
+    aoStr *word;
+    aoStr *definition;
+    long long queued; /* serverTimeMs */
+    int attempts; /* failed writes so far */
+} serverPersist;
+
+/* Sent back from a background save's child just before it exits */
+typedef struct serverBgsaveReport {
+    int status;
+    size_t cow;
+} serverBgsaveReport;
+
+dictionaryServer server;
+
+int
+serverDaemonise(char *dir)
+{
+    pid_t proccessId;
+
+    if ((proccessId = fork()) < 0) {
+        warning("Error Daemon: Failed to fork() 1 %s\n", strerror(errno));
+        return SERVER_ERR;
+    }
+
+    if (proccessId > 0)
+        exit(EXIT_SUCCESS);
+
+    if (setsid() < 0)
+        exit(EXIT_FAILURE);
+
+    if ((proccessId = fork()) < 0) {
+        warning("Error Daemon: Failed to fork() 2 %s\n", strerror(errno));
+        return SERVER_ERR;
+    }
+
+    if (proccessId > 0)
+        exit(EXIT_SUCCESS);
+
+    (void)umask(0);
+    if (chdir(dir) < 0)
+        return SERVER_ERR;
+
+    close(STDIN_FILENO);
+    close(STDOUT_FILENO);
+    close(STDERR_FILENO);
+
+    return SERVER_OK;
+}
+
+static long long
+serverTimeMs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static long long
+serverTimeUs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void
+serverPersistRelease(serverPersist *p)
+{
+    aoStrRelease(p->word);
+    aoStrRelease(p->definition);
+    free(p);
+}
+
+/* One of each per thread that compresses or decodes, made on first use */
+static _Thread_local ZSTD_CCtx *threadcctx = NULL;
+static _Thread_local ZSTD_DCtx *threaddctx = NULL;
+
+/* For threads that finish before the server does */
+static void
+serverCodecThreadRelease(void)
+{
+    ZSTD_freeCCtx(threadcctx);
+    ZSTD_freeDCtx(threaddctx);
+    threadcctx = NULL;
+    threaddctx = NULL;
+}
+
+/* A compressed definition is a zstd frame. Its magic number is not valid
+ * UTF-8 so a definition that does not start with it is plain text */
+static int
+serverIsCompressed(const char *definition, size_t len)
+{
+    const unsigned char *p = (const unsigned char *)definition;
+
+    return len >= 4 && ((unsigned int)p[0] | (unsigned int)p[1] << 8 |
+            (unsigned int)p[2] << 16 | (unsigned int)p[3] << 24) ==
+            ZSTD_MAGICNUMBER;
+}
+
+/* 0 if it is not a compressed definition or does not say */
+static size_t
+serverDecodedLen(const char *definition, size_t len)
+{
+    unsigned long long decodedlen;
+
+    if (!serverIsCompressed(definition, len))
+        return 0;
+    decodedlen = ZSTD_getFrameContentSize(definition, len);
+    if (decodedlen == ZSTD_CONTENTSIZE_UNKNOWN ||
+            decodedlen == ZSTD_CONTENTSIZE_ERROR || decodedlen > UINT_MAX)
+        return 0;
+    return decodedlen;
+}
+
+/* Back on the queue to be tried again, unless they are to blame for the
+ * failure or have been tried too many times. Those are dropped, they stay
+ * in the cache but never reach the table */
+static void
+serverPersistFailed(serverPersist **failed, int count, int isolated)
+{
+    serverPersist *p;
+
+    pthread_mutex_lock(&server.persistlock);
+    server.persiststats.failures++;
+    for (int i = count - 1; i >= 0; --i) {
+        p = failed[i];
+        if (!isolated && ++p->attempts < PERSIST_MAX_ATTEMPTS) {
+            listAddHead(server.persistqueue, p);
+            continue;
+        }
+        warning("SERVER ERROR: Dropping '%s', it could not be written\n",
+                p->word->data);
+        free(hmapDelete(server.persistpending, p->word));
+        server.persiststats.dropped++;
+        serverPersistRelease(p);
+    }
+    pthread_mutex_unlock(&server.persistlock);
+}
+
+/* One transaction for the whole batch, so one sync */
+static int
+serverPersistBatch(dbClient *db, serverPersist **batch, int count)
+{
+    dbStmt *stmt;
+    aoStr *def;
+
+    if ((stmt = dbStmtGet(db, SQL_INSERT)) == NULL || !dbExec(db, "BEGIN;"))
+        return SERVER_ERR;
+
+    for (int i = 0; i < count; ++i) {
+        def = batch[i]->definition;
+        if (!dbStmtBindText(stmt, 1, batch[i]->word->data,
+                    batch[i]->word->len) ||
+                !(serverIsCompressed(def->data, def->len) ?
+                        dbStmtBindBlob(stmt, 2, def->data, def->len) :
+                        dbStmtBindText(stmt, 2, def->data, def->len)) ||
+                dbStmtStep(stmt) == DB_ERR) {
+            dbStmtReset(stmt);
+            dbExec(db, "ROLLBACK;");
+            return SERVER_ERR;
+        }
+        dbStmtReset(stmt);
+    }
+
+    if (!dbExec(db, "COMMIT;")) {
+        dbExec(db, "ROLLBACK;");
+        return SERVER_ERR;
+    }
+
+    return SERVER_OK;
+}
+
+/* Drains the queue PERSIST_BATCH rows at a time. Rows stay pending until
+ * they are committed so a lookup still finds them, a batch that fails goes
+ * back on the front of the queue for the next flush */
+int
+serverPersistFlush(dbClient *db)
+{
+    serverPersist *batch[PERSIST_BATCH], *failed[PERSIST_BATCH], *p;
+    long long latency;
+    int count, written, nfailed, retval = SERVER_OK;
+
+    pthread_mutex_lock(&server.persistflushlock);
+    for (;;) {
+        count = 0;
+        pthread_mutex_lock(&server.persistlock);
+        while (count < PERSIST_BATCH &&
+                (p = listRemoveHead(server.persistqueue)) != NULL)
+            batch[count++] = p;
+        pthread_mutex_unlock(&server.persistlock);
+
+        if (count == 0)
+            break;
+
+        if (serverPersistBatch(db, batch, count) == SERVER_ERR) {
+            warning("SERVER ERROR: Failed to write %d words\n", count);
+            /* Row by row, so a word that can never be written is found
+             * and does not hold back the ones behind it */
+            written = nfailed = 0;
+            for (int i = 0; i < count; ++i) {
+                if (count > 1 &&
+                        serverPersistBatch(db, &batch[i], 1) == SERVER_OK)
+                    batch[written++] = batch[i];
+                else
+                    failed[nfailed++] = batch[i];
+            }
+            /* When none of it could be written the database is more
+             * likely at fault than the words */
+            serverPersistFailed(failed, nfailed, written > 0);
+            if ((count = written) == 0) {
+                retval = SERVER_ERR;
+                break;
+            }
+        }
+
+        /* The oldest in the batch waited longest */
+        latency = serverTimeMs() - batch[0]->queued;
+
+        /* Only now can a snapshot read them back from the table */
+        __atomic_add_fetch(&server.dirty, count, __ATOMIC_RELAXED);
+
+        pthread_mutex_lock(&server.persistlock);
+        for (int i = 0; i < count; ++i)
+            free(hmapDelete(server.persistpending, batch[i]->word));
+        server.persiststats.batches++;
+        server.persiststats.rows += count;
+        server.persiststats.lastbatch = count;
+        if (count > server.persiststats.maxbatch)
+            server.persiststats.maxbatch = count;
+        server.persiststats.lastms = latency;
+        if (latency > server.persiststats.maxms)
+            server.persiststats.maxms = latency;
+        pthread_mutex_unlock(&server.persistlock);
+
+        for (int i = 0; i < count; ++i)
+            serverPersistRelease(batch[i]);
+    }
+    pthread_mutex_unlock(&server.persistflushlock);
+
+    return retval;
+}
+
+/* Runs on the db thread. Anything queued after the flag is cleared either
+ * makes it into this flush or schedules another */
+void
+serverPersistWork(void *data)
+{
+    (void)data;
+
+    pthread_mutex_lock(&server.persistlock);
+    server.persistscheduled = 0;
+    pthread_mutex_unlock(&server.persistlock);
+
+    serverPersistFlush(server.db);
+}
+
+/* Must hold persistlock */
+static void
+serverPersistSchedule(void)
+{
+    if (server.persistscheduled || server.persistqueue->len == 0)
+        return;
+
+    server.persistscheduled = 1;
+    if (workpoolSubmit(server.dbpool, NULL, serverPersistWork, NULL, NULL) ==
+            WP_ERR)
+        server.persistscheduled = 0;
+}
+
+/* A new word from any thread. It is written out by the db thread once a
+ * batch has built up or PERSIST_WINDOW_MS has passed, whichever is first,
+ * so nobody waits on the database to get their definition */
+void
+serverPersistQueue(char *word, int wordlen, aoStr *definition)
+{
+    serverPersist *p;
+
+    if ((p = malloc(sizeof(serverPersist))) == NULL) {
+        warning("SERVER ERROR: Failed to queue '%s' for writing\n", word);
+        return;
+    }
+
+    p->word = aoStrDupRaw(word, wordlen, wordlen + 1);
+    p->definition = aoStrDupRaw(definition->data, definition->len,
+            definition->len + 1);
+    p->queued = serverTimeMs();
+    p->attempts = 0;
+
+    pthread_mutex_lock(&server.persistlock);
+    if (hmapGet(server.persistpending, p->word) != NULL) {
+        pthread_mutex_unlock(&server.persistlock);
+        serverPersistRelease(p);
+        return;
+    }
+
+    listAddTail(server.persistqueue, p);
+    hmapAdd(server.persistpending, p->word, p);
+    if (server.persistqueue->len >= PERSIST_BATCH)
+        serverPersistSchedule();
+    pthread_mutex_unlock(&server.persistlock);
+}
+
+/* A copy of the definition if `word` is waiting to be written, NULL if
+ * not */
+aoStr *
+serverPersistGet(char *word, int wordlen)
+{
+    aoStr key = {.data = word, .len = wordlen};
+    aoStr *definition = NULL;
+    serverPersist *p;
+
+    pthread_mutex_lock(&server.persistlock);
+    if ((p = hmapGet(server.persistpending, &key)) != NULL)
+        definition = aoStrDupRaw(p->definition->data, p->definition->len,
+                p->definition->len + 1);
+    pthread_mutex_unlock(&server.persistlock);
+
+    return definition;
+}
+
+long long
+serverPersistCron(eloop *el, long long id, void *data)
+{
+    (void)el;
+    (void)id;
+    (void)data;
+
+    pthread_mutex_lock(&server.persistlock);
+    serverPersistSchedule();
+    pthread_mutex_unlock(&server.persistlock);
+
+    return PERSIST_WINDOW_MS;
+}
+
+int
+serverConsultMerriam(serverThread *t, char *word, httpCallback *cb,
+        void *data)
+{
+    /* The longest word a request can carry fits */
+    char url[sizeof(MERRIAM_WEBSTER) + PROTO_MAX_KEYLEN + 1];
+    int len;
+
+    len = snprintf(url, sizeof(url), "%s/%s", MERRIAM_WEBSTER, word);
+    if (len < 0 || (size_t)len >= sizeof(url))
+        return HTTP_ERR;
+
+    return httpMultiGet(t->http, url, cb, data);
+}
+
+/* What a definition is once decoded */
+static size_t
+serverDefinitionLen(const char *definition, size_t len)
+{
+    size_t decodedlen;
+
+    if ((decodedlen = serverDecodedLen(definition, len)) != 0)
+        return decodedlen;
+    return len;
+}
+
+/* The compressed definition in `*scratch`, grown as needed, with -z and if
+ * it comes out smaller. Otherwise `definition` as it is */
+static const char *
+serverCompressInto(char **scratch, size_t *cap, const char *definition,
+        size_t len, size_t *outlen)
+{
+    size_t bound;
+    char *buf;
+
+    *outlen = len;
+    if (!server.compress || server.cdict == NULL || len == 0 ||
+            serverIsCompressed(definition, len))
+        return definition;
+
+    if (threadcctx == NULL && (threadcctx = ZSTD_createCCtx()) == NULL)
+        return definition;
+
+    if ((bound = ZSTD_compressBound(len)) > *cap) {
+        if ((buf = realloc(*scratch, bound)) == NULL)
+            return definition;
+        *scratch = buf;
+        *cap = bound;
+    }
+
+    bound = ZSTD_compress_usingCDict(threadcctx, *scratch, *cap, definition,
+            len, server.cdict);
+    if (ZSTD_isError(bound) || bound >= len)
+        return definition;
+
+    *outlen = bound;
+    return *scratch;
+}
+
+/* Takes ownership of `definition` and hands back what should be stored */
+static aoStr *
+serverCompress(aoStr *definition)
+{
+    const char *data;
+    char *scratch = NULL;
+    size_t cap = 0, len;
+    aoStr *encoded;
+
+    if (definition == NULL)
+        return NULL;
+
+    data = serverCompressInto(&scratch, &cap, definition->data,
+            definition->len, &len);
+    if (data != definition->data) {
+        encoded = aoStrDupRaw((char *)data, len, len + 1);
+        aoStrRelease(definition);
+        definition = encoded;
+    }
+
+    free(scratch);
+    return definition;
+}
+
+/* Whatever came from the database at startup lives in the arenas and is
+ * freed with them */
+static void
+serverCacheRelease(void *str)
+{
+    for (int i = 0; i < LOAD_THREADS; ++i)
+        if (server.loadarenas[i] && arenaOwns(server.loadarenas[i], str))
+            return;
+    aoStrRelease(str);
+}
+
+/* The key is released by the chmap on its own */
+static void
+serverCacheItemRelease(void *_item)
+{
+    serverCacheItem *item = _item;
+    serverCacheRelease(item->value);
+    slabFree(server.itemslab, item);
+}
+
+static void *
+serverCacheEntryAlloc(size_t size)
+{
+    (void)size;
+    return slabAlloc(server.entryslab);
+}
+
+static void
+serverCacheEntryFree(void *entry)
+{
+    slabFree(server.entryslab, entry);
+}
+
+/* Keys are aoStrs so the length is never recomputed on a lookup */
+static hmapType serverCacheType = {
+    .keycmp = hmapAoStrCmp,
+    .hashFn = hmapHashAoStr,
+    .freekey = serverCacheRelease,
+    .freevalue = serverCacheItemRelease,
+    .allocentry = serverCacheEntryAlloc,
+    .freeentry = serverCacheEntryFree,
+};
+
+/* Both belong to the serverPersist */
+static hmapType serverPersistType = {
+    .keycmp = hmapAoStrCmp,
+    .hashFn = hmapHashAoStr,
+    .freekey = NULL,
+    .freevalue = NULL,
+};
+
+/* The key belongs to the lookupRequest, it is freed with it */
+static hmapType serverInflightType = {
+    .keycmp = hmapAoStrCmp,
+    .hashFn = hmapHashAoStr,
+    .freekey = NULL,
+    .freevalue = NULL,
+};
+
+/* Takes no locks, the caller has to be inside an epoch section for as long
+ * as it uses the definition */
+aoStr *
+serverCacheGet(char *word, int wordlen)
+{
+    aoStr key = {.data = word, .len = wordlen};
+    serverCacheItem *item;
+
+    if ((item = chmapGet(server.cache, &key)) == NULL)
+        return NULL;
+
+    /* Only written when it changes so hot entries stay shared between
+     * cores */
+    if (!__atomic_load_n(&item->ref, __ATOMIC_RELAXED))
+        __atomic_store_n(&item->ref, 1, __ATOMIC_RELAXED);
+    return item->value;
+}
+
+/* Must hold the cache lock. Moves the hand on to whatever would be evicted
+ * next and returns it without evicting it */
+static serverCacheItem *
+serverClockVictim(void)
+{
+    serverCacheItem *item;
+
+    while (server.clocklen > 0) {
+        if (server.clockhand >= server.clocklen)
+            server.clockhand = 0;
+
+        item = server.clock[server.clockhand];
+        if (!__atomic_load_n(&item->ref, __ATOMIC_RELAXED))
+            return item;
+
+        __atomic_store_n(&item->ref, 0, __ATOMIC_RELAXED);
+        server.clockhand++;
+    }
+
+    return NULL;
+}
+
+/* Must hold the cache lock. What serverClockVictim would most likely
+ * return, found without clearing any reference bits or moving the hand so
+ * a word that is turned away leaves the clock as it was. If everything
+ * nearby has been used the one at the hand stands in */
+static serverCacheItem *
+serverClockPeek(void)
+{
+    serverCacheItem *item;
+    unsigned int idx;
+
+    if (server.clocklen == 0)
+        return NULL;
+
+    idx = server.clockhand >= server.clocklen ? 0 : server.clockhand;
+    for (unsigned int i = 0; i < SERVER_CLOCK_PEEK && i < server.clocklen;
+            ++i) {
+        item = server.clock[(idx + i) % server.clocklen];
+        if (!__atomic_load_n(&item->ref, __ATOMIC_RELAXED))
+            return item;
+    }
+
+    return server.clock[idx];
+}
+
+/* Must hold the cache lock. CLOCK rather than LRU so a hit is one store
+ * and not a list update under a lock. Evicted entries are still in the
+ * database and are read back from there when asked for again */
+static void
+serverCacheEvict(void)
+{
+    serverCacheItem *item;
+
+    while (server.cacheused > server.cachebudget &&
+            (item = serverClockVictim()) != NULL) {
+        /* The last one takes its place, the hand looks at it next */
+        server.clock[server.clockhand] = server.clock[--server.clocklen];
+        server.cacheused -= item->bytes;
+        server.cachedefinitions -= item->value->len;
+        server.cacheraw -= serverDefinitionLen(item->value->data,
+                item->value->len);
+        chmapDelete(server.cache, item->key);
+    }
+}
+
+/* Must hold the cache lock. A word only gets in when it would push
+ * something out if it is asked for more often than what it pushes out, so
+ * one off lookups do not flush popular words */
+static int
+serverCacheAdmit(serverCacheItem *item)
+{
+    serverCacheItem *victim;
+
+    if (server.sketch == NULL ||
+            server.cacheused + item->bytes <= server.cachebudget)
+        return 1;
+
+    if ((victim = serverClockPeek()) == NULL)
+        return 1;
+
+    return tinylfuAdmit(server.sketch,
+            hmapHashBytes(item->key->data, item->key->len),
+            hmapHashBytes(victim->key->data, victim->key->len));
+}
+
+/* Must hold the cache lock */
+static int
+serverClockPush(serverCacheItem *item)
+{
+    serverCacheItem **clock;
+    unsigned int cap;
+
+    if (server.clocklen == server.clockcap) {
+        cap = server.clockcap ? server.clockcap * 2 : 1024;
+        if ((clock = realloc(server.clock, cap * sizeof(*clock))) == NULL)
+            return SERVER_ERR;
+        server.clock = clock;
+        server.clockcap = cap;
+    }
+
+    server.clock[server.clocklen++] = item;
+    return SERVER_OK;
+}
+
+/* Must hold the cache lock. Takes ownership of the key and definition only
+ * when they were added, HM_ERR if it was not admitted. The loader does not
+ * push anything out, it gets HM_ERR once there is no room left */
+static int
+serverCacheInsertLocked(aoStr *key, aoStr *definition, int loading)
+{
+    serverCacheItem *item;
+    int retval;
+
+    if ((item = slabAlloc(server.itemslab)) == NULL)
+        return HM_ERR;
+
+    item->key = key;
+    item->value = definition;
+    item->ref = 1;
+    item->bytes = sizeof(chmapEntry) + sizeof(serverCacheItem) +
+            2 * sizeof(aoStr) + key->capacity + definition->capacity;
+
+    if (loading ? server.cachebudget &&
+                    server.cacheused + item->bytes > server.cachebudget :
+                  !serverCacheAdmit(item)) {
+        slabFree(server.itemslab, item);
+        return HM_ERR;
+    }
+
+    if ((retval = chmapAdd(server.cache, key, item)) != HM_OK) {
+        slabFree(server.itemslab, item);
+        return retval;
+    }
+
+    server.cacheused += item->bytes;
+    server.cachedefinitions += definition->len;
+    server.cacheraw += serverDefinitionLen(definition->data, definition->len);
+    if (server.cachebudget) {
+        /* Not being able to track it only means it is never evicted */
+        serverClockPush(item);
+        serverCacheEvict();
+    }
+
+    return HM_OK;
+}
+
+static int
+serverCacheInsert(aoStr *key, aoStr *definition, int loading)
+{
+    int retval;
+
+    pthread_mutex_lock(&server.cachelock);
+    retval = serverCacheInsertLocked(key, definition, loading);
+    pthread_mutex_unlock(&server.cachelock);
+
+    return retval;
+}
+
+/* Takes ownership of the definition only when it was added */
+int
+serverCacheAdd(char *word, int wordlen, aoStr *definition)
+{
+    aoStr *key;
+    int retval;
+
+    key = aoStrDupRaw(word, wordlen, wordlen);
+    if ((retval = serverCacheInsert(key, definition, 0)) != HM_OK)
+        aoStrRelease(key);
+
+    return retval;
+}
+
+/* A word goes into a url and is used as a key everywhere by its length, only
+ * letters, digits, hyphens and apostrophes get that far */
+static int
+serverWordIsValid(const char *word, int len)
+{
+    for (int i = 0; i < len; ++i) {
+        unsigned char ch = word[i];
+        if (!isalnum(ch) && ch != '-' && ch != '\'')
+            return 0;
+    }
+    return 1;
+}
+
+/* Lookups are case insensitive, everything is keyed by the lower case word */
+void
+serverNormaliseWord(char *word, int len)
+{
+    for (int i = 0; i < len; ++i)
+        word[i] = tolower((unsigned char)word[i]);
+}
+
+/* Runs on a fetch pool thread, it must not touch the cache or the database */
+aoStr *
+serverParseDefinition(httpResponse *resp)
+{
+    aoStr *all_matches;
+    list *l;
+
+    all_matches = NULL;
+    if ((l = htmlGetMatches(resp->body, "dtText")) != NULL) {
+        all_matches = htmlConcatList(l);
+        listRelease(l);
+    }
+
+    return all_matches;
+}
+
+/* Decoded straight into `buf` after its header, `buf` is left as it was if
+ * it can not be */
+static int
+serverFrameDecoded(aoStr *buf, const char *definition, size_t len)
+{
+    unsigned char header[PROTO_RES_HEADER_LEN];
+    size_t decodedlen, need;
+
+    if (server.ddict == NULL ||
+            (decodedlen = serverDecodedLen(definition, len)) == 0)
+        return SERVER_ERR;
+
+    if (threaddctx == NULL && (threaddctx = ZSTD_createDCtx()) == NULL)
+        return SERVER_ERR;
+
+    need = sizeof(header) + decodedlen;
+    if (buf->len + need >= buf->capacity &&
+            aoStrExtendBuffer(buf, need) != 1)
+        return SERVER_ERR;
+
+    if (ZSTD_decompress_usingDDict(threaddctx,
+                buf->data + buf->len + sizeof(header), decodedlen,
+                definition, len, server.ddict) != decodedlen)
+        return SERVER_ERR;
+
+    protoEncodeResponseHeader(header, PROTO_OP_DEFINE, PROTO_STATUS_OK, 0,
+            decodedlen);
+    memcpy(buf->data + buf->len, header, sizeof(header));
+    buf->len += sizeof(header) + decodedlen;
+    buf->data[buf->len] = '\0';
+    return SERVER_OK;
+}
+
+/* An empty definition is a NOT_FOUND with no body, so is one that can not
+ * be decoded */
+void
+serverFrameReplyRaw(aoStr *buf, const char *definition, size_t len)
+{
+    unsigned char header[PROTO_RES_HEADER_LEN];
+
+    if (serverIsCompressed(definition, len)) {
+        if (serverFrameDecoded(buf, definition, len) == SERVER_OK)
+            return;
+        warning("SERVER ERROR: Failed to decode a definition\n");
+        len = 0;
+    }
+
+    if (len == 0) {
+        protoEncodeResponseHeader(header, PROTO_OP_DEFINE,
+                PROTO_STATUS_NOT_FOUND, 0, 0);
+        aoStrCatLen(buf, header, sizeof(header));
+        return;
+    }
+
+    protoEncodeResponseHeader(header, PROTO_OP_DEFINE, PROTO_STATUS_OK, 0,
+            len);
+    aoStrCatLen(buf, header, sizeof(header));
+    aoStrCatLen(buf, definition, len);
+}
+
+/* So is a missing one */
+void
+serverFrameReply(aoStr *buf, aoStr *definition)
+{
+    if (definition == NULL)
+        serverFrameReplyRaw(buf, NULL, 0);
+    else
+        serverFrameReplyRaw(buf, definition->data, definition->len);
+}
+
+void
+serverFrameError(aoStr *buf, int opcode, int status)
+{
+    unsigned char header[PROTO_RES_HEADER_LEN];
+
+    protoEncodeResponseHeader(header, opcode, status, 0, 0);
+    aoStrCatLen(buf, header, sizeof(header));
+}
+
+void
+serverClientRelease(serverClient *c)
+{
+    serverReply *reply;
+
+    while ((reply = listRemoveHead(c->replies)) != NULL) {
+        aoStrRelease(reply->payload);
+        free(reply);
+    }
+
+    listRelease(c->replies);
+    aoStrRelease(c->querybuf);
+    aoStrRelease(c->outbuf);
+    free(c);
+}
+
+/* Replies still waiting on a lookup keep the client alive, the last one to
+ * finish frees it */
+void
+serverCloseClient(eloop *el, serverClient *c)
+{
+    serverReply *reply;
+    list *pending;
+
+    c->thread->clientcount--;
+    eloopDeleteEvent(el, c->fd, EVT_READ | EVT_WRITE);
+    close(c->fd);
+    c->fd = -1;
+
+    pending = listNew();
+    while ((reply = listRemoveHead(c->replies)) != NULL) {
+        if (reply->ready) {
+            aoStrRelease(reply->payload);
+            free(reply);
+        } else {
+            listAddTail(pending, reply);
+        }
+    }
+    listRelease(c->replies);
+    c->replies = pending;
+
+    if (c->pending == 0)
+        serverClientRelease(c);
+}
+
+void serverReadFromClient(eloop *el, int fd, void *data, int mask);
+void serverWriteToClient(eloop *el, int fd, void *data, int mask);
+
+/* Write while there is output, read while the client is sending and is
+ * keeping up with its replies. A client that stops reading its replies stops
+ * being read from until it catches up */
+void
+serverUpdateClientEvents(serverClient *c)
+{
+    eloop *el = c->thread->evtloop;
+    int mask = 0;
+
+    if (c->outbuf->offset < c->outbuf->len)
+        mask |= EVT_WRITE;
+
+    if (!c->eof && c->replies->len < MAX_PENDING &&
+            c->outbuf->len - c->outbuf->offset < MAX_OUTBUF)
+        mask |= EVT_READ;
+
+    if ((mask & EVT_READ) && !(c->mask & EVT_READ))
+        eloopAddEvent(el, c->fd, EVT_READ, serverReadFromClient, c);
+    if ((mask & EVT_WRITE) && !(c->mask & EVT_WRITE))
+        eloopAddEvent(el, c->fd, EVT_WRITE, serverWriteToClient, c);
+    if (c->mask & ~mask)
+        eloopDeleteEvent(el, c->fd, c->mask & ~mask);
+
+    c->mask = mask;
+}
+
+/* Returns SERVER_ERR if the connection should be closed */
+int
+serverFlushClient(serverClient *c)
+{
+    serverReply *reply;
+    aoStr *out = c->outbuf;
+    ssize_t sbytes;
+
+    /* Replies have to go out in the order they were asked for */
+    while (c->replies->len > 0) {
+        reply = c->replies->root->data;
+        if (!reply->ready)
+            break;
+        listRemoveHead(c->replies);
+        aoStrCatLen(out, reply->payload->data, reply->payload->len);
+        aoStrRelease(reply->payload);
+        free(reply);
+    }
+
+    while (out->offset < out->len) {
+        sbytes = write(c->fd, out->data + out->offset, out->len - out->offset);
+        if (sbytes == -1) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            warning("[%d] SERVER ERROR: Failed to write reply: %s\n",
+                    server.pid, strerror(errno));
+            return SERVER_ERR;
+        }
+        out->offset += sbytes;
+    }
+
+    /* Whatever did not fit goes out when the socket is writable again */
+    if (out->offset == out->len) {
+        out->offset = 0;
+        aoStrSetLen(out, 0);
+    } else if (out->offset > MAX_OUTBUF / 2) {
+        memmove(out->data, out->data + out->offset, out->len - out->offset);
+        aoStrSetLen(out, out->len - out->offset);
+        out->offset = 0;
+    }
+
+    if (c->eof && c->replies->len == 0 && out->len == 0)
+        return SERVER_ERR;
+
+    serverUpdateClientEvents(c);
+    return SERVER_OK;
+}
+
+void
+serverWriteToClient(eloop *el, int fd, void *data, int mask)
+{
+    (void)fd;
+    (void)mask;
+    serverClient *c = data;
+
+    if (serverFlushClient(c) == SERVER_ERR)
+        serverCloseClient(el, c);
+}
+
+void
+serverLookupWork(void *_req)
+{
+    lookupRequest *req = _req;
+    req->definition = serverCompress(serverParseDefinition(req->resp));
+    httpResponseRelease(req->resp);
+    req->resp = NULL;
+}
+
+/* Runs on the thread that owns the reply's client */
+void
+serverReplyReady(void *_reply)
+{
+    serverReply *reply = _reply;
+    serverClient *c = reply->c;
+
+    reply->ready = 1;
+    c->pending--;
+
+    if (c->fd == -1) {
+        if (c->pending == 0)
+            serverClientRelease(c);
+    } else if (serverFlushClient(c) == SERVER_ERR) {
+        serverCloseClient(c->thread->evtloop, c);
+    }
+}
+
+/* Back on the eventloop of the thread that did the fetch. Waiters on other
+ * threads get their reply through that thread's mailbox as their clients
+ * may only be touched from there */
+void
+serverLookupDone(void *_req)
+{
+    lookupRequest *req = _req;
+    serverReply *reply;
+    aoStr *uncached = NULL;
+    int retval;
+
+    pthread_mutex_lock(&server.inflightlock);
+    free(hmapDelete(server.inflight, &req->key));
+    pthread_mutex_unlock(&server.inflightlock);
+
+    epochEnter();
+    if (req->definition) {
+        retval = serverCacheAdd(req->word, req->wordlen, req->definition);
+        if (retval == HM_FOUND) {
+            /* Someone else got there first */
+            aoStrRelease(req->definition);
+            req->definition = serverCacheGet(req->word, req->wordlen);
+        } else {
+            /* Not worth caching yet, this lookup still gets answered */
+            if (retval != HM_OK)
+                uncached = req->definition;
+            if (!req->fromdb)
+                serverPersistQueue(req->word, req->wordlen, req->definition);
+        }
+    }
+
+    while ((reply = listRemoveHead(req->waiters)) != NULL) {
+        serverFrameReply(reply->payload, req->definition);
+
+        if (reply->c->thread == req->thread)
+            serverReplyReady(reply);
+        else
+            workpoolMailboxPost(reply->c->thread->mailbox, serverReplyReady,
+                    reply);
+    }
+    epochExit();
+
+    aoStrRelease(uncached);
+    listRelease(req->waiters);
+    free(req->word);
+    free(req);
+}
+
+/* Called on the eventloop when merriam webster has answered, parsing the
+ * html is comparatively slow so it goes to the parse pool */
+void
+serverFetchDone(httpResponse *resp, void *_req)
+{
+    lookupRequest *req = _req;
+
+    if (resp == NULL || resp->status_code != 200) {
+        httpResponseRelease(resp);
+        serverLookupDone(req);
+        return;
+    }
+
+    req->resp = resp;
+    if (workpoolSubmit(server.parsepool, req->thread->mailbox,
+                serverLookupWork, serverLookupDone, req) == WP_ERR) {
+        httpResponseRelease(resp);
+        req->resp = NULL;
+        serverLookupDone(req);
+    }
+}
+
+/* Runs on the db thread, the word may have been evicted but still be in
+ * the database */
+void
+serverDbLookupWork(void *_req)
+{
+    lookupRequest *req = _req;
+    char *definition;
+    int len;
+
+    /* Queued but not written yet */
+    if ((req->definition = serverPersistGet(req->word, req->wordlen))) {
+        req->fromdb = 1;
+        return;
+    }
+
+    definition = dbStmtQueryText(dbStmtGet(server.db, SQL_LOOKUP), req->word,
+            req->wordlen, &len);
+    if (definition) {
+        req->definition = serverCompress(aoStrDupRaw(definition, len,
+                len + 1));
+        req->fromdb = 1;
+        free(definition);
+    }
+}
+
+/* Only a word that has never been looked up goes to merriam webster */
+void
+serverDbLookupDone(void *_req)
+{
+    lookupRequest *req = _req;
+
+    if (req->fromdb) {
+        serverLookupDone(req);
+        return;
+    }
+
+    if (serverConsultMerriam(req->thread, req->word, serverFetchDone, req) ==
+            HTTP_ERR)
+        serverLookupDone(req);
+}
+
+/* Queues a reply slot for a miss, it is filled in when the lookup for the
+ * word completes */
+int
+serverQueueLookup(serverClient *c, char *word, int wordlen)
+{
+    aoStr key = {.data = word, .len = wordlen};
+    lookupRequest *req;
+    serverReply *reply;
+
+    if ((reply = malloc(sizeof(serverReply))) == NULL)
+        return SERVER_ERR;
+
+    reply->c = c;
+    reply->ready = 0;
+    reply->payload = aoStrAlloc(PROTO_RES_HEADER_LEN);
+    listAddTail(c->replies, reply);
+    c->pending++;
+
+    /* Already being fetched for someone else, possibly on another thread,
+     * wait for that one */
+    pthread_mutex_lock(&server.inflightlock);
+    if ((req = hmapGet(server.inflight, &key)) != NULL) {
+        listAddTail(req->waiters, reply);
+        pthread_mutex_unlock(&server.inflightlock);
+        return SERVER_OK;
+    }
+
+    if ((req = malloc(sizeof(lookupRequest))) == NULL ||
+            (req->word = malloc(wordlen + 1)) == NULL) {
+        pthread_mutex_unlock(&server.inflightlock);
+        free(req);
+        serverFrameReply(reply->payload, NULL);
+        reply->ready = 1;
+        c->pending--;
+        return SERVER_OK;
+    }
+
+    req->thread = c->thread;
+    memcpy(req->word, word, wordlen);
+    req->word[wordlen] = '\0';
+    req->wordlen = wordlen;
+    req->key = (aoStr){.data = req->word, .len = wordlen};
+    req->waiters = listNew();
+    req->resp = NULL;
+    req->definition = NULL;
+    req->fromdb = 0;
+    listAddTail(req->waiters, reply);
+    hmapAdd(server.inflight, &req->key, req);
+    pthread_mutex_unlock(&server.inflightlock);
+
+    /* With no budget everything in the database is cached once loading has
+     * finished, unless the snapshot was used instead */
+    if (server.cachebudget ||
+            __atomic_load_n(&server.loading, __ATOMIC_ACQUIRE) ||
+            __atomic_load_n(&server.snapshot, __ATOMIC_ACQUIRE)) {
+        if (workpoolSubmit(server.dbpool, req->thread->mailbox,
+                    serverDbLookupWork, serverDbLookupDone, req) == WP_ERR)
+            workpoolMailboxPost(req->thread->mailbox, serverLookupDone, req);
+        return SERVER_OK;
+    }
+
+    /* Fetch without blocking the loop, the reply is written once the
+     * definition has been downloaded and parsed. Failing here still has to
+     * answer the waiters, but not while this client is mid request */
+    if (serverConsultMerriam(req->thread, req->word, serverFetchDone, req) ==
+            HTTP_ERR)
+        workpoolMailboxPost(req->thread->mailbox, serverLookupDone, req);
+
+    return SERVER_OK;
+}
+
+/* Queues an already complete reply behind anything still pending */
+int
+serverQueueReady(serverClient *c, aoStr *payload)
+{
+    serverReply *reply;
+
+    if ((reply = malloc(sizeof(serverReply))) == NULL) {
+        aoStrRelease(payload);
+        return SERVER_ERR;
+    }
+
+    reply->c = c;
+    reply->ready = 1;
+    reply->payload = payload;
+    listAddTail(c->replies, reply);
+
+    return SERVER_OK;
+}
+
+/* The database and its write ahead log on disk */
+static long long
+serverDbBytes(void)
+{
+    struct stat st;
+    long long bytes = 0;
+
+    if (stat(DB_NAME, &st) == 0)
+        bytes += st.st_size;
+    if (stat(DB_NAME "-wal", &st) == 0)
+        bytes += st.st_size;
+    return bytes;
+}
+
+/* `name:value` lines describing the cache */
+void
+serverStatsInfo(aoStr *buf)
+{
+    tinylfu *t = server.sketch;
+    unsigned long long hits = 0, misses = 0, snapshothits = 0;
+    serverPersistStats persist;
+    snapshot *snap;
+    size_t used, depth, definitions, raw;
+
+    pthread_mutex_lock(&server.cachelock);
+    used = server.cacheused;
+    definitions = server.cachedefinitions;
+    raw = server.cacheraw;
+    pthread_mutex_unlock(&server.cachelock);
+
+    for (int i = 0; i < server.threadcount; ++i) {
+        hits += __atomic_load_n(&server.threads[i].hits, __ATOMIC_RELAXED);
+        misses += __atomic_load_n(&server.threads[i].misses,
+                __ATOMIC_RELAXED);
+        snapshothits += __atomic_load_n(&server.threads[i].snapshothits,
+                __ATOMIC_RELAXED);
+    }
+
+    aoStrCatPrintf(buf, "hits:%llu\n", hits);
+    aoStrCatPrintf(buf, "misses:%llu\n", misses);
+    aoStrCatPrintf(buf, "cache_entries:%u\n", chmapSize(server.cache));
+    aoStrCatPrintf(buf, "cache_bytes:%zu\n", used);
+    aoStrCatPrintf(buf, "cache_budget:%zu\n", server.cachebudget);
+    aoStrCatPrintf(buf, "cache_definition_bytes:%zu\n", definitions);
+    aoStrCatPrintf(buf, "cache_definition_raw_bytes:%zu\n", raw);
+    aoStrCatPrintf(buf, "compress:%d\n", server.compress);
+    aoStrCatPrintf(buf, "codec_dict_bytes:%zu\n", server.codecdictlen);
+    aoStrCatPrintf(buf, "db_bytes:%lld\n", serverDbBytes());
+
+    pthread_mutex_lock(&server.persistlock);
+    persist = server.persiststats;
+    depth = server.persistqueue->len;
+    pthread_mutex_unlock(&server.persistlock);
+
+    aoStrCatPrintf(buf, "persist_queue_depth:%zu\n", depth);
+    aoStrCatPrintf(buf, "persist_batches:%llu\n", persist.batches);
+    aoStrCatPrintf(buf, "persist_rows:%llu\n", persist.rows);
+    aoStrCatPrintf(buf, "persist_failures:%llu\n", persist.failures);
+    aoStrCatPrintf(buf, "persist_dropped:%llu\n", persist.dropped);
+    aoStrCatPrintf(buf, "persist_last_batch:%d\n", persist.lastbatch);
+    aoStrCatPrintf(buf, "persist_max_batch:%d\n", persist.maxbatch);
+    aoStrCatPrintf(buf, "persist_last_latency_ms:%lld\n", persist.lastms);
+    aoStrCatPrintf(buf, "persist_max_latency_ms:%lld\n", persist.maxms);
+
+    epochEnter();
+    if ((snap = __atomic_load_n(&server.snapshot, __ATOMIC_ACQUIRE))) {
+        aoStrCatPrintf(buf, "snapshot_entries:%u\n", snapshotCount(snap));
+        aoStrCatPrintf(buf, "snapshot_bytes:%zu\n", snap->size);
+        aoStrCatPrintf(buf, "snapshot_hits:%llu\n", snapshothits);
+    }
+    epochExit();
+
+    /* The bgsave fields are only written by the first thread, they can be
+     * seen mid update from another */
+    aoStrCatPrintf(buf, "snapshot_dirty:%llu\n",
+            __atomic_load_n(&server.dirty, __ATOMIC_RELAXED));
+    aoStrCatPrintf(buf, "bgsave_in_progress:%d\n",
+            __atomic_load_n(&server.snapshotting, __ATOMIC_RELAXED));
+    aoStrCatPrintf(buf, "bgsave_last_status:%s\n",
+            server.bgsavestatus == SERVER_OK ? "ok" : "err");
+    aoStrCatPrintf(buf, "bgsave_last_fork_us:%lld\n", server.bgsaveforkus);
+    aoStrCatPrintf(buf, "bgsave_last_ms:%lld\n", server.bgsavems);
+    aoStrCatPrintf(buf, "bgsave_last_cow_bytes:%zu\n", server.bgsavecow);
+
+    if (t) {
+        aoStrCatPrintf(buf, "sketch_width:%u\n", t->width);
+        aoStrCatPrintf(buf, "sketch_additions:%u\n",
+                __atomic_load_n(&t->additions, __ATOMIC_RELAXED));
+        aoStrCatPrintf(buf, "sketch_resets:%llu\n",
+                __atomic_load_n(&t->resets, __ATOMIC_RELAXED));
+        aoStrCatPrintf(buf, "admitted:%llu\n",
+                __atomic_load_n(&t->admitted, __ATOMIC_RELAXED));
+        aoStrCatPrintf(buf, "rejected:%llu\n",
+                __atomic_load_n(&t->rejected, __ATOMIC_RELAXED));
+    }
+}
+
+/* What the admission sketch knows about one word */
+void
+serverStatsWord(aoStr *buf, char *word, int wordlen)
+{
+    unsigned int counters[TINYLFU_DEPTH];
+    uint64_t hash;
+
+    aoStrCatPrintf(buf, "word:%s\n", word);
+    if (server.sketch == NULL)
+        return;
+
+    hash = hmapHashBytes(word, wordlen);
+    tinylfuCounters(server.sketch, hash, counters);
+    aoStrCatPrintf(buf, "frequency:%u\n",
+            tinylfuEstimate(server.sketch, hash));
+    aoStrCatPrintf(buf, "counters:");
+    for (int i = 0; i < TINYLFU_DEPTH; ++i)
+        aoStrCatPrintf(buf, i ? " %u" : "%u", counters[i]);
+    aoStrCatPrintf(buf, "\n");
+}
+
+/* Frames `body` as the reply and releases it */
+int
+serverQueueText(serverClient *c, int opcode, int status, aoStr *body)
+{
+    unsigned char header[PROTO_RES_HEADER_LEN];
+    aoStr *payload;
+
+    payload = aoStrAlloc(body->len + PROTO_RES_HEADER_LEN);
+    protoEncodeResponseHeader(header, opcode, status, 0, body->len);
+    aoStrCatLen(payload, header, sizeof(header));
+    aoStrCatLen(payload, body->data, body->len);
+    aoStrRelease(body);
+
+    return serverQueueReady(c, payload);
+}
+
+int
+serverProcessStats(serverClient *c, char *word, int wordlen)
+{
+    aoStr *body;
+
+    body = aoStrAlloc(512);
+    if (wordlen)
+        serverStatsWord(body, word, wordlen);
+    else
+        serverStatsInfo(body);
+
+    return serverQueueText(c, PROTO_OP_STATS, PROTO_STATUS_OK, body);
+}
+
+void serverBgsaveWork(void *data);
+
+/* Connected over loopback or a unix socket */
+static int
+serverClientIsLocal(serverClient *c)
+{
+    struct sockaddr_storage addr;
+    socklen_t len = sizeof(addr);
+    struct in6_addr *in6;
+
+    if (getpeername(c->fd, (struct sockaddr *)&addr, &len) == -1)
+        return 0;
+
+    switch (addr.ss_family) {
+    case AF_UNIX:
+        return 1;
+    case AF_INET:
+        return (ntohl(((struct sockaddr_in *)&addr)->sin_addr.s_addr) >>
+                       24) == 127;
+    case AF_INET6:
+        in6 = &((struct sockaddr_in6 *)&addr)->sin6_addr;
+        return IN6_IS_ADDR_LOOPBACK(in6) ||
+                (IN6_IS_ADDR_V4MAPPED(in6) && in6->s6_addr[12] == 127);
+    default:
+        return 0;
+    }
+}
+
+/* Background saves are only started from the first thread. A save forks
+ * and writes out the whole dictionary, so a remote client does not get to
+ * ask for one */
+int
+serverProcessSave(serverClient *c)
+{
+    aoStr *body = aoStrAlloc(64);
+
+    if (!serverClientIsLocal(c)) {
+        aoStrCatPrintf(body, "Background saves can only be started "
+                             "locally\n");
+        return serverQueueText(c, PROTO_OP_SAVE, PROTO_STATUS_BAD_REQUEST,
+                body);
+    }
+
+    if (__atomic_load_n(&server.snapshotting, __ATOMIC_ACQUIRE))
+        aoStrCatPrintf(body, "Background save already in progress\n");
+    else if (workpoolMailboxPost(server.threads[0].mailbox, serverBgsaveWork,
+                     NULL) == WP_ERR)
+        aoStrCatPrintf(body, "Failed to start background save\n");
+    else
+        aoStrCatPrintf(body, "Background save started\n");
+
+    return serverQueueText(c, PROTO_OP_SAVE, PROTO_STATUS_OK, body);
+}
+
+int
+serverProcessRequest(serverClient *c, protoRequest *preq)
+{
+    aoStr *response, *payload;
+    snapshot *snap;
+    const char *definition;
+    char word[PROTO_MAX_KEYLEN + 1];
+    size_t len;
+    int wordlen;
+
+    if (preq->opcode == PROTO_OP_SAVE)
+        return serverProcessSave(c);
+
+    if (((preq->opcode != PROTO_OP_DEFINE || preq->keylen == 0) &&
+                preq->opcode != PROTO_OP_STATS) ||
+            !serverWordIsValid(preq->key, preq->keylen)) {
+        payload = aoStrAlloc(PROTO_RES_HEADER_LEN);
+        serverFrameError(payload, preq->opcode, PROTO_STATUS_BAD_REQUEST);
+        return serverQueueReady(c, payload);
+    }
+
+    wordlen = preq->keylen;
+    memcpy(word, preq->key, wordlen);
+    word[wordlen] = '\0';
+    serverNormaliseWord(word, wordlen);
+
+    if (preq->opcode == PROTO_OP_STATS)
+        return serverProcessStats(c, word, wordlen);
+
+    if (server.sketch)
+        tinylfuIncrement(server.sketch, hmapHashBytes(word, wordlen));
+
+    /* The snapshot is only looked at after the cache, it holds nothing
+     * added since it was written */
+    epochEnter();
+    if ((response = serverCacheGet(word, wordlen)) != NULL) {
+        definition = response->data;
+        len = response->len;
+    } else if ((snap = __atomic_load_n(&server.snapshot, __ATOMIC_ACQUIRE)) !=
+                    NULL &&
+            (definition = snapshotGet(snap, word, wordlen, &len)) != NULL) {
+        __atomic_store_n(&c->thread->snapshothits,
+                c->thread->snapshothits + 1, __ATOMIC_RELAXED);
+    } else {
+        epochExit();
+        __atomic_store_n(&c->thread->misses, c->thread->misses + 1,
+                __ATOMIC_RELAXED);
+        return serverQueueLookup(c, word, wordlen);
+    }
+    __atomic_store_n(&c->thread->hits, c->thread->hits + 1,
+            __ATOMIC_RELAXED);
+
+    /* Nothing ahead of it, skip the reply queue */
+    if (c->replies->len == 0) {
+        serverFrameReplyRaw(c->outbuf, definition, len);
+        epochExit();
+        return SERVER_OK;
+    }
+
+    payload = aoStrAlloc(len + PROTO_RES_HEADER_LEN);
+    serverFrameReplyRaw(payload, definition, len);
+    epochExit();
+    return serverQueueReady(c, payload);
+}
+
+/* Connections stay open and can carry any number of framed requests,
+ * several may arrive in one read */
+void
+serverReadFromClient(eloop *el, int fd, void *data, int mask)
+{
+    (void)mask;
+    serverClient *c = data;
+    protoRequest preq;
+    unsigned char *frame;
+    ssize_t rbytes;
+    size_t consumed;
+    int rc;
+
+    /* Keep reading until the socket is drained so a frame split over
+     * several segments is processed in one go */
+    for (int i = 0; i < MAX_READS; ++i) {
+        aoStrExtendBufferIfNeeded(c->querybuf, READ_CHUNK);
+        rbytes = read(fd, c->querybuf->data + c->querybuf->len, READ_CHUNK);
+
+        if (rbytes == -1) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            goto error;
+        }
+
+        /* Half closed, the replies already asked for are still owed */
+        if (rbytes == 0) {
+            c->eof = 1;
+            break;
+        }
+
+        aoStrSetLen(c->querybuf, c->querybuf->len + rbytes);
+        if (rbytes < READ_CHUNK)
+            break;
+    }
+
+    consumed = 0;
+    while (1) {
+        frame = (unsigned char *)c->querybuf->data + consumed;
+        rc = protoDecodeRequest(frame, c->querybuf->len - consumed, &preq);
+        if (rc == PROTO_INCOMPLETE)
+            break;
+        if (rc == PROTO_ERR)
+            goto error;
+        if (serverProcessRequest(c, &preq) == SERVER_ERR)
+            goto error;
+        consumed += preq.framelen;
+    }
+
+    if (consumed) {
+        memmove(c->querybuf->data, c->querybuf->data + consumed,
+                c->querybuf->len - consumed);
+        aoStrSetLen(c->querybuf, c->querybuf->len - consumed);
+    }
+
+    if (serverFlushClient(c) == SERVER_ERR)
+        goto error;
+    return;
+
+error:
+    serverCloseClient(el, c);
+}
+
+serverClient *
+serverClientCreate(serverThread *t, int fd)
+{
+    serverClient *c;
+
+    if ((c = malloc(sizeof(serverClient))) == NULL)
+        return NULL;
+
+    c->thread = t;
+    c->fd = fd;
+    c->pending = 0;
+    c->mask = EVT_READ;
+    c->eof = 0;
+    c->querybuf = aoStrAlloc(READ_CHUNK);
+    c->outbuf = aoStrAlloc(MAX_MSG);
+    c->replies = listNew();
+
+    return c;
+}
+
+void
+serverAccept(eloop *el, int fd, void *data, int mask)
+{
+    (void)mask;
+    serverThread *t = data;
+    serverClient *c;
+    int sockfd;
+
+    if ((sockfd = inetAcceptNonBlocking(fd)) == INET_ERR)
+        return;
+
+    if ((c = serverClientCreate(t, sockfd)) == NULL) {
+        close(sockfd);
+        return;
+    }
+
+    if (eloopAddEvent(el, sockfd, EVT_READ, serverReadFromClient, c) ==
+            EVT_ERR) {
+        serverClientRelease(c);
+        close(sockfd);
+        return;
+    }
+
+    t->clientcount++;
+}
+
+/* The aoStr and its bytes in one go, it is never grown */
+static aoStr *
+serverArenaStr(arena *a, const char *s, size_t len)
+{
+    aoStr *str;
+
+    if ((str = arenaAlloc(a, sizeof(aoStr) + len + 1)) == NULL)
+        panic("SERVER ERROR: Failed to allocate %zu bytes\n", len);
+
+    str->data = (char *)(str + 1);
+    memcpy(str->data, s, len);
+    str->data[len] = '\0';
+    str->len = len;
+    str->offset = 0;
+    str->capacity = len + 1;
+    return str;
+}
+
+/* Merges what the loader has collected into the cache, DB_ERR once the
+ * cache is full */
+static int
+serverLoaderFlush(serverLoader *l)
+{
+    int retval = DB_OK, rc;
+
+    pthread_mutex_lock(&server.cachelock);
+    for (int i = 0; i < l->count; ++i) {
+        if (retval == DB_OK) {
+            /* Found means it was asked for since it was read */
+            if ((rc = serverCacheInsertLocked(l->keys[i], l->values[i], 1)) ==
+                    HM_OK)
+                continue;
+            if (rc == HM_ERR) {
+                l->full = 1;
+                retval = DB_ERR;
+            }
+        }
+
+        if (l->arena == NULL) {
+            aoStrRelease(l->keys[i]);
+            aoStrRelease(l->values[i]);
+        }
+    }
+    pthread_mutex_unlock(&server.cachelock);
+
+    l->count = 0;
+    return retval;
+}
+
+int
+serverTransferToCache(void *_l, int columncount, dbColumn *row)
+{
+    serverLoader *l = _l;
+    const char *definition;
+    size_t len;
+    aoStr lookup;
+    int found;
+
+    if (columncount != 2)
+        panic("SERVER ERROR: expected 2 columns got %d\n", columncount);
+
+    if (row[0].ptr == NULL || row[1].ptr == NULL)
+        return DB_OK;
+
+    /* Already asked for while loading, or loaded as a hot word */
+    lookup.data = (char *)row[0].ptr;
+    lookup.len = row[0].len;
+    epochEnter();
+    found = chmapGet(server.cache, &lookup) != NULL;
+    epochExit();
+    if (found)
+        return DB_OK;
+
+    definition = serverCompressInto(&l->scratch, &l->scratchcap, row[1].ptr,
+            row[1].len, &len);
+
+    /* Evictable entries have to be freed one at a time */
+    if (l->arena) {
+        l->keys[l->count] = serverArenaStr(l->arena, row[0].ptr, row[0].len);
+        l->values[l->count] = serverArenaStr(l->arena, definition, len);
+    } else {
+        l->keys[l->count] = aoStrDupRaw((char *)row[0].ptr, row[0].len,
+                row[0].len + 1);
+        l->values[l->count] = aoStrDupRaw((char *)definition, len, len + 1);
+    }
+
+    if (++l->count == LOAD_BATCH)
+        return serverLoaderFlush(l);
+    return DB_OK;
+}
+
+/* Whatever is left in the batch is merged even if reading stopped early */
+static int
+serverLoaderRun(serverLoader *l, char *sql)
+{
+    int retval;
+
+    retval = dbForEachRow(l->db, sql, l, serverTransferToCache);
+    if (serverLoaderFlush(l) == DB_ERR)
+        retval = DB_ERR;
+    return retval;
+}
 
-int
-serverDaemonise(char *dir)
+/* Each loader thread reads its own range of rowids on its own connection */
+void *
+serverLoaderMain(void *_l)
 {
-    pid_t proccessId;
+    serverLoader *l = _l;
+    char sqlselectstmt[200];
+    int len;
 
-    if ((proccessId = fork()) < 0) {
-        warning("Error Daemon: Failed to fork() 1 %s\n", strerror(errno));
-        return SERVER_ERR;
+    if ((l->db = dbConnect(DB_NAME)) == NULL) {
+        warning("SERVER ERROR: Loader failed to connect to the database\n");
+        return NULL;
     }
 
-    if (proccessId > 0)
-        exit(EXIT_SUCCESS);
+    len = snprintf(sqlselectstmt, 200,
+            "SELECT word, definitions FROM %s WHERE rowid BETWEEN %lld AND "
+            "%lld;",
+            DB_TABLE, l->from, l->to);
+    sqlselectstmt[len] = '\0';
 
-    if (setsid() < 0)
-        exit(EXIT_FAILURE);
+    serverLoaderRun(l, sqlselectstmt);
+    dbRelease(l->db);
+    epochThreadRelease();
+    serverCodecThreadRelease();
+    return NULL;
+}
 
-    if ((proccessId = fork()) < 0) {
-        warning("Error Daemon: Failed to fork() 2 %s\n", strerror(errno));
-        return SERVER_ERR;
+/* Runs while the server is taking requests, words that were asked for most
+ * often last time go first so they are in before anything else and are
+ * the ones to make it in when there is a budget. The rest of the table is
+ * split into rowid ranges read in parallel */
+void *
+serverLoadMain(void *data)
+{
+    (void)data;
+    char sqlhotstmt[300], sqlrangestmt[200];
+    serverLoader *loaders;
+    dbClient *db;
+    long long start, minrowid, maxrowid, span;
+    int len, threadcount, started;
+
+    start = serverTimeMs();
+
+    if ((loaders = calloc(LOAD_THREADS, sizeof(serverLoader))) == NULL)
+        panic("SERVER ERROR: Failed to allocate loaders\n");
+
+    len = snprintf(sqlhotstmt, 300,
+            "SELECT d.word, d.definitions FROM %s f "
+            "JOIN %s d ON d.word = f.word ORDER BY f.hits DESC;",
+            DB_FREQ_TABLE, DB_TABLE);
+    sqlhotstmt[len] = '\0';
+
+    /* server.db belongs to the db thread, like the range loaders this one
+     * gets a connection of its own */
+    if ((db = dbConnect(DB_NAME)) == NULL) {
+        warning("SERVER ERROR: Loader failed to connect to the database\n");
+        goto done;
     }
 
-    if (proccessId > 0)
-        exit(EXIT_SUCCESS);
+    loaders[0].db = db;
+    loaders[0].arena = server.loadarenas[0];
+
+    /* Anything that does not fit in the budget is read from the database
+     * when it is asked for. The order is only a preference, without it the
+     * ranges below still load everything */
+    if (serverLoaderRun(&loaders[0], sqlhotstmt) == DB_ERR &&
+            !loaders[0].full)
+        warning("SERVER ERROR: Failed to load the most used words first, "
+                "loading in table order\n");
+
+    len = snprintf(sqlrangestmt, 200, "SELECT MIN(rowid) FROM %s;", DB_TABLE);
+    sqlrangestmt[len] = '\0';
+    minrowid = dbQueryInt(db, sqlrangestmt);
+
+    len = snprintf(sqlrangestmt, 200, "SELECT MAX(rowid) FROM %s;", DB_TABLE);
+    sqlrangestmt[len] = '\0';
+    maxrowid = dbQueryInt(db, sqlrangestmt);
+    dbRelease(db);
+
+    /* Rowids can have gaps, the ranges are only roughly even */
+    span = maxrowid - minrowid + 1;
+    threadcount = sysconf(_SC_NPROCESSORS_ONLN);
+    if (threadcount > LOAD_THREADS)
+        threadcount = LOAD_THREADS;
+    if (threadcount > span / LOAD_MIN_ROWS)
+        threadcount = span / LOAD_MIN_ROWS;
+    if (threadcount < 1)
+        threadcount = 1;
+
+    started = 0;
+    for (int i = 0; i < threadcount; ++i) {
+        loaders[i].count = 0;
+        loaders[i].arena = server.loadarenas[i];
+        loaders[i].from = minrowid + span * i / threadcount;
+        loaders[i].to = minrowid + span * (i + 1) / threadcount - 1;
+
+        if (pthread_create(&loaders[i].tid, NULL, serverLoaderMain,
+                    &loaders[i]) != 0) {
+            /* This thread reads whatever could not be handed out */
+            loaders[i].to = maxrowid;
+            serverLoaderMain(&loaders[i]);
+            break;
+        }
+        started++;
+    }
 
-    (void)umask(0);
-    if (chdir(dir) < 0)
-        return SERVER_ERR;
+    for (int i = 0; i < started; ++i)
+        pthread_join(loaders[i].tid, NULL);
 
-    close(STDIN_FILENO);
-    close(STDOUT_FILENO);
-    close(STDERR_FILENO);
+done:
+    for (int i = 0; i < LOAD_THREADS; ++i)
+        free(loaders[i].scratch);
+    free(loaders);
+    __atomic_store_n(&server.loading, 0, __ATOMIC_RELEASE);
+    epochThreadRelease();
+    serverCodecThreadRelease();
 
-    return SERVER_OK;
+    printf("[%d]: server cache loaded %u entries in %lldms\n", server.pid,
+            chmapSize(server.cache), serverTimeMs() - start);
+    return NULL;
 }
 
-int
-serverPesistToDb(char *word, aoStr *definition)
+typedef struct serverFreqSnapshot {
+    int count;
+    aoStr **words;
+    unsigned int *hits;
+} serverFreqSnapshot;
+
+/* Runs on the db thread, replaces the whole table in one transaction */
+void
+serverFreqSaveWork(void *_save)
 {
-    char sqlstmt[65535];
-    int len;
+    serverFreqSnapshot *save = _save;
+    dbStmt *stmt = dbStmtGet(server.db, SQL_FREQ_INSERT);
+    dbStmt *delete = dbStmtGet(server.db, SQL_FREQ_DELETE);
+    int retval;
+
+    if (!dbExec(server.db, "BEGIN;"))
+        goto cleanup;
+
+    retval = dbStmtStep(delete);
+    dbStmtReset(delete);
+    if (retval == DB_ERR)
+        goto rollback;
+
+    for (int i = 0; i < save->count; ++i) {
+        if (!dbStmtBindText(stmt, 1, save->words[i]->data,
+                    save->words[i]->len) ||
+                !dbStmtBindInt(stmt, 2, save->hits[i]) ||
+                dbStmtStep(stmt) == DB_ERR) {
+            dbStmtReset(stmt);
+            goto rollback;
+        }
+        dbStmtReset(stmt);
+    }
 
-    len = snprintf(sqlstmt, 65535,
-            "INSERT INTO %s (word, definitions) VALUES ('%s', '%s');", DB_TABLE,
-            word, definition->data);
-    sqlstmt[len] = '\0';
+    if (dbExec(server.db, "COMMIT;"))
+        goto cleanup;
+
+rollback:
+    warning("SERVER ERROR: Failed to save word frequencies\n");
+    dbExec(server.db, "ROLLBACK;");
 
-    return dbExec(server.db, sqlstmt);
+cleanup:
+    for (int i = 0; i < save->count; ++i)
+        aoStrRelease(save->words[i]);
+    free(save->words);
+    free(save->hits);
+    free(save);
 }
 
-httpResponse *
-serverConsultMerriam(char *word)
+/* Snapshots what the admission sketch says about every cached word, the
+ * next start loads them in that order */
+long long
+serverFreqCron(eloop *el, long long id, void *data)
 {
-    char url[500] = { '\0' };
-    int len;
+    (void)el;
+    (void)id;
+    (void)data;
+    serverFreqSnapshot *save;
+    serverCacheItem *item;
+    unsigned int hits;
+
+    if (server.sketch == NULL)
+        return SERVER_FREQ_MS;
+
+    if ((save = malloc(sizeof(serverFreqSnapshot))) == NULL)
+        return SERVER_FREQ_MS;
+
+    pthread_mutex_lock(&server.cachelock);
+    save->count = 0;
+    save->words = malloc(sizeof(aoStr *) * (server.clocklen + 1));
+    save->hits = malloc(sizeof(unsigned int) * (server.clocklen + 1));
+
+    if (save->words && save->hits) {
+        for (unsigned int i = 0; i < server.clocklen; ++i) {
+            item = server.clock[i];
+            hits = tinylfuEstimate(server.sketch,
+                    hmapHashBytes(item->key->data, item->key->len));
+            if (hits == 0)
+                continue;
+            save->words[save->count] = aoStrDupRaw(item->key->data,
+                    item->key->len, item->key->len + 1);
+            save->hits[save->count++] = hits;
+        }
+    }
+    pthread_mutex_unlock(&server.cachelock);
+
+    if (save->words == NULL || save->hits == NULL ||
+            workpoolSubmit(server.dbpool, NULL, serverFreqSaveWork, NULL,
+                    save) == WP_ERR) {
+        for (int i = 0; i < save->count; ++i)
+            aoStrRelease(save->words[i]);
+        free(save->words);
+        free(save->hits);
+        free(save);
+    }
+
+    return SERVER_FREQ_MS;
+}
+
+/* Written from the table rather than the cache, definitions are
+ * compressed on the way with -z like they would be in the cache */
+typedef struct serverSnapshotTable {
+    snapshotWriter *w;
+    char *scratch;
+    size_t scratchcap;
+} serverSnapshotTable;
+
+static int
+serverSnapshotRow(void *_t, int columncount, dbColumn *row)
+{
+    serverSnapshotTable *t = _t;
+    const char *definition;
+    size_t len;
+
+    if (columncount != 2)
+        panic("SERVER ERROR: expected 2 columns got %d\n", columncount);
 
-    len = snprintf(url, 500, "%s/%s", MERRIAM_WEBSTER, word);
-    url[len] = '\0';
+    if (row[0].ptr == NULL || row[1].ptr == NULL)
+        return DB_OK;
 
-    return curlHttpGet(url);
+    /* The writer copies the key, the definition goes straight out */
+    definition = serverCompressInto(&t->scratch, &t->scratchcap, row[1].ptr,
+            row[1].len, &len);
+    if (snapshotWriterAdd(t->w, (char *)row[0].ptr, row[0].len,
+                (char *)definition, len) == SNAP_ERR)
+        return DB_ERR;
+    return DB_OK;
 }
 
-int
-serverReadClientMessage(char *msg, char *word, int *len)
+/* An insert replaces the row of a word that is already stored, the cache
+ * is given the new definition first. So the cache is written out as is and
+ * the old snapshot only fills in the words the cache does not have */
+static int
+serverSnapshotItem(void *key, void *value, void *w)
 {
-    char *ptr, strnum[200] = { '\0' }, tmpword[200] = { '\0' };
-    ptr = msg;
+    (void)key;
+    serverCacheItem *item = value;
 
-    for (unsigned long i = 0;
-            i < sizeof(tmpword) && *ptr != ':' && *ptr != '\0'; ++i) {
-        tmpword[i] = *ptr++;
-    }
+    if (item->value->len == 0)
+        return HM_OK;
 
-    if (*ptr == '\0')
-        return SERVER_ERR;
+    if (snapshotWriterAdd(w, item->key->data, item->key->len,
+                item->value->data, item->value->len) == SNAP_ERR)
+        return HM_ERR;
+    return HM_OK;
+}
 
-    ptr++;
+static int
+serverSnapshotEntry(void *w, char *key, size_t keylen, char *value,
+        size_t valuelen)
+{
+    aoStr lookup = {.data = key, .len = keylen};
 
-    for (unsigned long i = 0; i < sizeof(strnum) && *ptr != '\0'; ++i) {
-        if (!isdigit(*ptr))
-            return SERVER_ERR;
-        strnum[i] = *ptr++;
-    }
+    if (chmapGet(server.cache, &lookup) != NULL)
+        return SNAP_OK;
+    return snapshotWriterAdd(w, key, keylen, value, valuelen);
+}
+
+static void
+serverSnapshotRelease(void *snap, void *ctx)
+{
+    (void)ctx;
+    snapshotClose(snap);
+}
+
+/* Readers still looking at the old mapping keep it until they leave */
+static int
+serverSnapshotSwap(unsigned long long dirty, long long start)
+{
+    snapshot *snap, *old;
+
+    if ((snap = snapshotOpen(SNAP_NAME)) == NULL)
+        return SERVER_ERR;
 
-    *len = atoi(strnum);
-    tmpword[*len] = '\0';
-    memcpy(word, tmpword, *len);
-    word[*len] = '\0';
+    old = __atomic_exchange_n(&server.snapshot, snap, __ATOMIC_ACQ_REL);
+    if (old)
+        epochRetire(old, serverSnapshotRelease, NULL);
 
+    __atomic_sub_fetch(&server.dirty, dirty, __ATOMIC_RELAXED);
+    printf("[%d]: snapshot of %u words written in %lldms\n", server.pid,
+            snapshotCount(snap), serverTimeMs() - start);
     return SERVER_OK;
 }
 
-aoStr *
-serverLookupClientRequest(char *reqword, int reqwordlen)
+/* The cache and the snapshot hold everything in the table once the whole
+ * table has been loaded or written out at least once. Not with a budget,
+ * a word added since the last snapshot may already have been evicted */
+static int
+serverSnapshotFromMemory(void)
 {
-    aoStr *definition;
-    httpResponse *resp;
+    return server.cachebudget == 0 &&
+            (__atomic_load_n(&server.snapshot, __ATOMIC_ACQUIRE) ||
+                    !__atomic_load_n(&server.loading, __ATOMIC_ACQUIRE));
+}
 
-    if ((definition = hmapGet(server.cache, reqword)) != NULL) {
-        return definition;
-    }
-    // go to the internet and find a definition
-    if ((resp = serverConsultMerriam(reqword)) == NULL)
+/* The cache and the old snapshot. Nothing else may swap the snapshot while
+ * this runs, and
+ * outside of a child it has to be inside an epoch section so evicted keys
+ * stay valid until they have been written */
+int
+serverSnapshotWrite(void)
+{
+    snapshotWriter *w;
+    snapshot *snap = server.snapshot;
+
+    if ((w = snapshotWriterCreate(SNAP_NAME, SNAP_BORROW_KEYS)) == NULL)
         return SERVER_ERR;
 
-    if (resp->status_code == 200) {
-        list *l = htmlGetMatches(resp->body, "dtText");
-        aoStr *all_matches = htmlConcatList(l);
+    if (chmapForEach(server.cache, serverSnapshotItem, w) == HM_ERR ||
+            (snap && snapshotForEach(snap, serverSnapshotEntry, w) ==
+                            SNAP_ERR)) {
+        snapshotWriterAbort(w);
+        return SERVER_ERR;
+    }
 
-        hmapAdd(server.cache, reqword, all_matches);
-        serverPesistToDb(reqword, all_matches);
-        listRelease(l);
-        httpResponseRelease(resp);
-        return all_matches;
+    return snapshotWriterFinish(w) == SNAP_OK ? SERVER_OK : SERVER_ERR;
+}
+
+/* Writes the table out to SNAP_NAME on its own connection and swaps the
+ * new file in. Only for when the cache is missing words that are in the
+ * table. Queued words are written first so the snapshot has them, `dirty`
+ * only counts what has been committed */
+int
+serverSnapshotSave(void)
+{
+    serverSnapshotTable t = {0};
+    dbClient *db;
+    char sqlstmt[200];
+    unsigned long long dirty;
+    long long start;
+    int len, retval = SERVER_ERR;
+
+    pthread_mutex_lock(&server.snapshotlock);
+    start = serverTimeMs();
+
+    if ((db = dbConnect(DB_NAME)) == NULL)
+        goto unlock;
+
+    if (serverPersistFlush(db) == SERVER_ERR)
+        goto release;
+    dirty = __atomic_load_n(&server.dirty, __ATOMIC_RELAXED);
+
+    if ((t.w = snapshotWriterCreate(SNAP_NAME, 0)) == NULL)
+        goto release;
+
+    len = snprintf(sqlstmt, 200, "SELECT word, definitions FROM %s;",
+            DB_TABLE);
+    sqlstmt[len] = '\0';
+
+    if (dbForEachRow(db, sqlstmt, &t, serverSnapshotRow) == DB_ERR) {
+        snapshotWriterAbort(t.w);
+        goto release;
     }
 
-    return NULL;
+    if (snapshotWriterFinish(t.w) == SNAP_OK)
+        retval = serverSnapshotSwap(dirty, start);
+
+release:
+    free(t.scratch);
+    dbRelease(db);
+unlock:
+    pthread_mutex_unlock(&server.snapshotlock);
+    if (retval == SERVER_ERR)
+        warning("SERVER ERROR: Failed to write snapshot\n");
+    return retval;
 }
 
-void
-serverSendClientReply(eloop *el, int fd, void *data, int mask)
+void *
+serverSnapshotMain(void *data)
 {
-    (void)el;
     (void)data;
-    aoStr *response = NULL;
-    char msg[MAX_MSG] = { '\0' }, word[MAX_MSG - 100] = { '\0' };
-    int rbytes, wordlen, sbytes;
+    serverSnapshotSave();
+    epochThreadRelease();
+    serverCodecThreadRelease();
+    __atomic_store_n(&server.snapshotting, 0, __ATOMIC_RELEASE);
+    return NULL;
+}
 
-    if ((rbytes = read(fd, msg, MAX_MSG)) < 0)
-        goto error;
+/* What the child has made private by the time it is done, every page
+ * either of them wrote to while it ran */
+static size_t
+serverPrivateDirty(void)
+{
+    size_t total = 0;
+#ifdef __linux__
+    char line[256];
+    size_t kb;
+    FILE *fp;
+
+    if ((fp = fopen("/proc/self/smaps_rollup", "r")) == NULL &&
+            (fp = fopen("/proc/self/smaps", "r")) == NULL)
+        return 0;
+
+    while (fgets(line, sizeof(line), fp))
+        if (sscanf(line, "Private_Dirty: %zu kB", &kb) == 1)
+            total += kb << 10;
+    fclose(fp);
+#endif
+    return total;
+}
 
-    if (!serverReadClientMessage(msg, word, &wordlen))
-        goto error;
+/* The child walks its copy of the cache as a reader would, taking no locks
+ * as they may have been held by other threads when it was forked. Only the
+ * pages the server writes to while it runs are copied */
+static void
+serverBgsaveChild(int fd)
+{
+    serverBgsaveReport report;
 
-    if ((response = serverLookupClientRequest(word, wordlen)) == NULL) {
-        if (write(fd, "Failed to find word", 19) != 19) {
-            warning("SERVER ERROR: Failed to write error reply\n",
-                    strerror(errno));
-            goto error;
+    for (int i = 0; i < server.threadcount; ++i)
+        close(server.threads[i].sfd);
+
+    report.status = serverSnapshotWrite();
+    report.cow = serverPrivateDirty();
+    if (write(fd, &report, sizeof(report)) != sizeof(report))
+        report.status = SERVER_ERR;
+
+    _exit(report.status == SERVER_OK ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+/* Only called from the first thread's loop. A budgeted cache that has
+ * never been written out is missing words, the table is read on a thread
+ * instead of forking */
+int
+serverBgsave(void)
+{
+    pthread_t tid;
+    long long start;
+    int fds[2];
+    pid_t pid;
+
+    if (server.bgsavepid != -1 ||
+            __atomic_exchange_n(&server.snapshotting, 1, __ATOMIC_ACQ_REL))
+        return SERVER_ERR;
+
+    if (!serverSnapshotFromMemory()) {
+        if (__atomic_load_n(&server.loading, __ATOMIC_ACQUIRE) ||
+                pthread_create(&tid, NULL, serverSnapshotMain, NULL) != 0) {
+            __atomic_store_n(&server.snapshotting, 0, __ATOMIC_RELEASE);
+            return SERVER_ERR;
         }
+        pthread_detach(tid);
+        return SERVER_OK;
+    }
+
+    if (pipe(fds) == -1)
+        goto error;
+
+    /* Or the child's exit would write out whatever is buffered again */
+    fflush(stdout);
+    start = serverTimeUs();
+    if ((pid = fork()) == -1) {
+        close(fds[0]);
+        close(fds[1]);
         goto error;
     }
 
-    if (response && response->len != 0) {
-        if ((sbytes = write(fd, response->data, response->len)) !=
-                response->len) {
-            warning("[%d] SERVER ERROR: Failed to write complete message"
-                    " of %d bytes in length, sent: %d, %s\n",
-                    response->len, sbytes, strerror(errno), server.pid);
-        } else {
-            printf("[%d]: server responded to '%s' OK\n", server.pid, word);
-        }
+    if (pid == 0) {
+        close(fds[0]);
+        serverBgsaveChild(fds[1]);
     }
 
-    // We're done with this
+    server.bgsaveforkus = serverTimeUs() - start;
+    server.bgsavestart = serverTimeMs();
+    server.bgsavedirty = __atomic_load_n(&server.dirty, __ATOMIC_RELAXED);
+    server.bgsavepid = pid;
+    server.bgsavefd = fds[0];
+    close(fds[1]);
+
+    printf("[%d]: background save started by %d, fork took %lldus\n",
+            server.pid, pid, server.bgsaveforkus);
+    return SERVER_OK;
+
 error:
-    server.clientcount--;
-    eloopDeleteEvent(el, fd, mask);
-    close(fd);
+    warning("SERVER ERROR: Failed to start background save %s\n",
+            strerror(errno));
+    __atomic_store_n(&server.snapshotting, 0, __ATOMIC_RELEASE);
+    return SERVER_ERR;
 }
 
 void
-serverAccept(eloop *el, int fd, void *data, int mask)
+serverBgsaveWork(void *data)
 {
-    (void)el;
-    (void)fd;
     (void)data;
-    int sockfd;
+    serverBgsave();
+}
 
-    if ((sockfd = inetAcceptNonBlocking(fd)) == INET_ERR)
+/* Reaps the child once it has exited and swaps its snapshot in. With
+ * `block` it is killed and waited for */
+void
+serverBgsaveDone(int block)
+{
+    serverBgsaveReport report;
+    char tmppath[PATH_MAX];
+    int status;
+    pid_t pid;
+
+    if (server.bgsavepid == -1)
         return;
 
-    if (eloopAddEvent(el, sockfd, mask, serverSendClientReply, NULL) == EVT_ERR)
+    if (block)
+        kill(server.bgsavepid, SIGKILL);
+
+    pid = waitpid(server.bgsavepid, &status, block ? 0 : WNOHANG);
+    if (pid == 0 || (pid == -1 && errno == EINTR))
         return;
 
-    server.clientcount++;
+    if (read(server.bgsavefd, &report, sizeof(report)) != sizeof(report))
+        report.status = SERVER_ERR;
+    close(server.bgsavefd);
+
+    server.bgsavems = serverTimeMs() - server.bgsavestart;
+    server.bgsavestatus = report.status;
+    if (report.status == SERVER_OK) {
+        server.bgsavecow = report.cow;
+        if (serverSnapshotSwap(server.bgsavedirty, server.bgsavestart) ==
+                SERVER_ERR)
+            server.bgsavestatus = SERVER_ERR;
+        else
+            printf("[%d]: background save copied %zu bytes on write\n",
+                    server.pid, report.cow);
+    } else {
+        /* A child that was killed leaves its file behind */
+        snapshotTempPath(tmppath, sizeof(tmppath), SNAP_NAME, server.bgsavepid);
+        unlink(tmppath);
+        if (!block)
+            warning("SERVER ERROR: Background save failed\n");
+    }
+
+    server.bgsavepid = -1;
+    __atomic_store_n(&server.snapshotting, 0, __ATOMIC_RELEASE);
 }
 
-void
-serverTransferToCache(void *_cache, int columncount, char **row)
+/* Only when words have been added since the last one */
+long long
+serverSnapshotCron(eloop *el, long long id, void *data)
 {
-    hmap *cache = _cache;
-    aoStr *value;
-    unsigned int keylen, valuelen;
+    (void)el;
+    (void)id;
+    (void)data;
 
-    if (columncount != 2)
-        panic("SERVER ERROR: expected 2 columns got %d\n", columncount);
+    if (__atomic_load_n(&server.dirty, __ATOMIC_RELAXED))
+        serverBgsave();
+    return SERVER_SNAPSHOT_MS;
+}
+
+/* Evicted words are looked up one at a time by the unique index, which
+ * inserts rely on for ON CONFLICT. Tables from before it could have a word
+ * more than once, the lookup found the first one added so that is kept */
+static void
+serverMigrateUnique(void)
+{
+    char sqlexiststmt[200], sqldupstmt[200], sqlmigratestmt[1000];
+    long long duplicates;
+    int len;
+
+    len = snprintf(sqlexiststmt, 200,
+            "SELECT COUNT(*) FROM sqlite_master"
+            " WHERE type = 'index' AND name = '%s_word_unique';",
+            DB_TABLE);
+    sqlexiststmt[len] = '\0';
+
+    if (dbQueryInt(server.db, sqlexiststmt))
+        return;
 
-    keylen = strlen(row[0]);
-    valuelen = strlen(row[1]);
+    len = snprintf(sqldupstmt, 200,
+            "SELECT COUNT(*) - COUNT(DISTINCT word) FROM %s;", DB_TABLE);
+    sqldupstmt[len] = '\0';
+    duplicates = dbQueryInt(server.db, sqldupstmt);
+
+    len = snprintf(sqlmigratestmt, 1000,
+            "BEGIN;"
+            "DELETE FROM %s WHERE rowid NOT IN"
+            " (SELECT MIN(rowid) FROM %s GROUP BY word);"
+            "DROP INDEX IF EXISTS %s_word;"
+            "CREATE UNIQUE INDEX %s_word_unique ON %s (word);"
+            "COMMIT;",
+            DB_TABLE, DB_TABLE, DB_TABLE, DB_TABLE, DB_TABLE);
+    sqlmigratestmt[len] = '\0';
+
+    if (!dbExec(server.db, sqlmigratestmt)) {
+        dbExec(server.db, "ROLLBACK;");
+        panic("SERVER ERROR: Failed to create index\n");
+    }
+
+    printf("[%d]: server removed %lld duplicate words\n", server.pid,
+            duplicates);
+}
+
+/* Both halves of the dictionary, zstd keeps its own copy of `dict` */
+static int
+serverCodecLoad(const void *dict, size_t len)
+{
+    if (ZSTD_getDictID_fromDict(dict, len) == 0 ||
+            (server.cdict = ZSTD_createCDict(dict, len,
+                    SERVER_CODEC_LEVEL)) == NULL ||
+            (server.ddict = ZSTD_createDDict(dict, len)) == NULL) {
+        ZSTD_freeCDict(server.cdict);
+        server.cdict = NULL;
+        return SERVER_ERR;
+    }
+
+    server.codecdictlen = len;
+    return SERVER_OK;
+}
+
+static int
+serverCodecRow(void *p, int columncount, dbColumn *row)
+{
+    (void)p;
+    (void)columncount;
+
+    if (row[0].ptr && serverCodecLoad(row[0].ptr, row[0].len) == SERVER_ERR)
+        panic("SERVER ERROR: Compression dictionary in %s is corrupt\n",
+                DB_CODEC_TABLE);
+    return DB_OK;
+}
+
+/* What zstd trains on, the definitions one after the other */
+typedef struct serverCodecSample {
+    int count;
+    aoStr *buf;
+    size_t lens[SERVER_CODEC_SAMPLES];
+} serverCodecSample;
+
+static int
+serverCodecSampleRow(void *p, int columncount, dbColumn *row)
+{
+    (void)columncount;
+    serverCodecSample *sample = p;
+
+    if (row[0].ptr == NULL || row[0].len == 0 ||
+            serverIsCompressed(row[0].ptr, row[0].len) ||
+            sample->count == SERVER_CODEC_SAMPLES)
+        return DB_OK;
+
+    aoStrCatLen(sample->buf, row[0].ptr, row[0].len);
+    sample->lens[sample->count++] = row[0].len;
+    return DB_OK;
+}
+
+/* Trained once and kept, whatever was compressed with it can only be read
+ * with it. Without -z one that is already there is still loaded so what
+ * was written with it can be decoded */
+static void
+serverInitCodec(long long rowcount)
+{
+    char sqlsamplestmt[200], *dict;
+    serverCodecSample *sample;
+    long long stride;
+    dbStmt *stmt;
+    size_t dictlen;
+    int len;
+
+    if (dbForEachRow(server.db, SQL_CODEC_GET, NULL,
+                serverCodecRow) == DB_ERR)
+        panic("SERVER ERROR: Failed to read %s\n", DB_CODEC_TABLE);
+
+    if (server.cdict || !server.compress)
+        return;
+
+    /* Spread over the whole table */
+    stride = rowcount / SERVER_CODEC_SAMPLES;
+    if (stride < 1)
+        stride = 1;
+
+    len = snprintf(sqlsamplestmt, 200,
+            "SELECT definitions FROM %s WHERE rowid %% %lld = 0 LIMIT %d;",
+            DB_TABLE, stride, SERVER_CODEC_SAMPLES);
+    sqlsamplestmt[len] = '\0';
+
+    if ((sample = calloc(1, sizeof(serverCodecSample))) == NULL ||
+            (sample->buf = aoStrAlloc(1 << 20)) == NULL ||
+            (dict = malloc(SERVER_CODEC_DICT)) == NULL)
+        panic("SERVER ERROR: Failed to allocate compression sample\n");
+
+    if (dbForEachRow(server.db, sqlsamplestmt, sample,
+                serverCodecSampleRow) == DB_ERR ||
+            sample->count < SERVER_CODEC_MIN) {
+        printf("[%d]: server has too few definitions to train compression\n",
+                server.pid);
+        goto cleanup;
+    }
+
+    dictlen = ZDICT_trainFromBuffer(dict, SERVER_CODEC_DICT,
+            sample->buf->data, sample->lens, sample->count);
+    if (ZDICT_isError(dictlen)) {
+        warning("SERVER ERROR: Failed to train compression %s\n",
+                ZDICT_getErrorName(dictlen));
+        goto cleanup;
+    }
+
+    if (serverCodecLoad(dict, dictlen) == SERVER_ERR)
+        panic("SERVER ERROR: Failed to load the compression dictionary\n");
+
+    /* Nothing can be compressed with a dictionary that was not kept */
+    if ((stmt = dbStmtGet(server.db, SQL_CODEC_PUT)) == NULL ||
+            !dbStmtBindBlob(stmt, 1, dict, dictlen) ||
+            dbStmtStep(stmt) == DB_ERR) {
+        warning("SERVER ERROR: Failed to save compression dictionary\n");
+        ZSTD_freeCDict(server.cdict);
+        ZSTD_freeDDict(server.ddict);
+        server.cdict = NULL;
+        server.ddict = NULL;
+        server.codecdictlen = 0;
+    } else {
+        printf("[%d]: server trained compression on %d definitions\n",
+                server.pid, sample->count);
+    }
+    if (stmt)
+        dbStmtReset(stmt);
 
-    value = aoStrDupRaw(row[1], valuelen, valuelen + 10);
-    hmapAdd(cache, strndup(row[0], keylen), value);
+cleanup:
+    aoStrRelease(sample->buf);
+    free(sample);
+    free(dict);
 }
 
+/* Only creates the tables and the cache, the rows are loaded in the
+ * background by serverLoadMain or served from the snapshot */
 void
 serverInitDictionary(void)
 {
-    char sqltablestmt[2000], sqlcountstmt[200], sqlselectstmt[200];
+    char sqltablestmt[2000], sqlcountstmt[200];
     int len;
     long long rowcount;
+    size_t expected;
 
     len = snprintf(sqltablestmt, 2000,
             "CREATE TABLE IF NOT EXISTS %s ( "
             " word TEXT NOT NULL,"
             " definitions TEXT"
+            ");"
+            "CREATE TABLE IF NOT EXISTS %s ( "
+            " word TEXT PRIMARY KEY,"
+            " hits INTEGER NOT NULL"
+            ");"
+            "CREATE TABLE IF NOT EXISTS %s ( "
+            " id INTEGER PRIMARY KEY,"
+            " dictionary BLOB NOT NULL"
             ");",
-            DB_TABLE);
+            DB_TABLE, DB_FREQ_TABLE, DB_CODEC_TABLE);
     sqltablestmt[len] = '\0';
 
     if (!dbExec(server.db, sqltablestmt))
         panic("SERVER ERROR: Failed to create table\n");
 
+    serverMigrateUnique();
+
+    /* Compiled here so the db thread only ever finds them in the cache */
+    if (!dbStmtGet(server.db, SQL_LOOKUP) ||
+            !dbStmtGet(server.db, SQL_INSERT) ||
+            !dbStmtGet(server.db, SQL_FREQ_DELETE) ||
+            !dbStmtGet(server.db, SQL_FREQ_INSERT))
+        panic("SERVER ERROR: Failed to prepare statements\n");
+
     len = snprintf(sqlcountstmt, 200, "SELECT COUNT(*) FROM %s;", DB_TABLE);
     sqlcountstmt[len] = '\0';
 
     rowcount = dbGetRowCount(server.db, sqlcountstmt);
+    serverInitCodec(rowcount);
+
+    if ((server.entryslab = slabCreate(sizeof(chmapEntry))) == NULL ||
+            (server.itemslab = slabCreate(sizeof(serverCacheItem))) == NULL)
+        panic("SERVER ERROR: Failed to create cache allocators\n");
+
+    /* Served from the page cache, only words added since it was written
+     * have to come from the table */
+    if ((server.snapshot = snapshotOpen(SNAP_NAME)) != NULL)
+        printf("[%d]: server serving %u words from %s\n", server.pid,
+                snapshotCount(server.snapshot), SNAP_NAME);
+    /* There is nothing to start the next one from yet */
+    else if (rowcount > 0)
+        server.dirty = 1;
+
+    if (server.cachebudget == 0 && server.snapshot == NULL)
+        for (int i = 0; i < LOAD_THREADS; ++i)
+            if ((server.loadarenas[i] = arenaCreate()) == NULL)
+                panic("SERVER ERROR: Failed to create load arena\n");
+
+    /* Sized up front so loading never has to grow it, with a budget only
+     * part of the table will fit */
+    server.cache = chmapCreateWithCapacity(&serverCacheType,
+            rowcount > 0 && server.cachebudget == 0 && server.snapshot == NULL ?
+                    (unsigned int)rowcount :
+                    0);
+    if (server.cache == NULL)
+        panic("SERVER ERROR: Failed to create cache\n");
+
+    /* No more words than fit in the budget or are in the table */
+    if (server.cachebudget) {
+        expected = server.cachebudget / SERVER_MIN_ENTRY;
+        if (rowcount > 0 && (size_t)rowcount < expected)
+            expected = rowcount;
+
+        if ((server.sketch = tinylfuCreate(expected)) == NULL)
+            panic("SERVER ERROR: Failed to create admission sketch\n");
+    }
 
-    if (rowcount != 0) {
-        len = snprintf(sqlselectstmt, 200, "SELECT * FROM %s ;", DB_TABLE);
-        sqlselectstmt[len] = '\0';
-        dbForEachRow(server.db, sqlselectstmt, server.cache,
-                serverTransferToCache);
+    if (rowcount != 0 && server.snapshot == NULL) {
+        server.loading = 1;
+        if (pthread_create(&server.loader, NULL, serverLoadMain, NULL) != 0)
+            panic("SERVER ERROR: Failed to start loader\n");
+        pthread_detach(server.loader);
     }
 }
 
@@ -297,40 +2713,214 @@ serverSetFileDescriptorLimit(void)
             (unsigned long long)targetlimit);
 }
 
+/* A second signal while the snapshot is being written kills the server */
+static void
+serverSignalHandler(int sig)
+{
+    server.shutdown = 1;
+    signal(sig, SIG_DFL);
+}
+
+/* A background save still running is thrown away, the snapshot is
+ * written here instead with the server no longer taking requests */
+static void
+serverShutdown(void)
+{
+    dbClient *db;
+    int retval = SERVER_OK;
+
+    printf("[%d]: server shutting down\n", server.pid);
+    serverBgsaveDone(1);
+
+    /* The db thread may be busy, this flush has a connection of its own */
+    if ((db = dbConnect(DB_NAME)) == NULL ||
+            serverPersistFlush(db) == SERVER_ERR)
+        warning("SERVER ERROR: Failed to write %zu queued words\n",
+                server.persistqueue->len);
+    if (db)
+        dbRelease(db);
+
+    if (__atomic_load_n(&server.dirty, __ATOMIC_RELAXED)) {
+        if (serverSnapshotFromMemory()) {
+            pthread_mutex_lock(&server.snapshotlock);
+            epochEnter();
+            retval = serverSnapshotWrite();
+            epochExit();
+            pthread_mutex_unlock(&server.snapshotlock);
+        } else {
+            retval = serverSnapshotSave();
+        }
+    }
+
+    if (retval == SERVER_ERR)
+        warning("SERVER ERROR: Failed to write snapshot\n");
+    exit(EXIT_SUCCESS);
+}
+
+/* The cache grows a few buckets per insert, this keeps it moving along while
+ * nothing is being added. Also where a shutdown or a finished background
+ * save is noticed */
+long long
+serverCron(eloop *el, long long id, void *data)
+{
+    (void)el;
+    (void)id;
+    (void)data;
+
+    if (server.shutdown)
+        serverShutdown();
+
+    serverBgsaveDone(0);
+    chmapRehashMilliseconds(server.cache, 1);
+    return SERVER_CRON_MS;
+}
+
+void
+serverThreadInit(serverThread *t, int id)
+{
+    t->id = id;
+    t->clientcount = 0;
+    t->hits = 0;
+    t->misses = 0;
+    t->snapshothits = 0;
+
+    if ((t->sfd = inetCreateServerReusePort(PORT, NULL, BACKLOG)) <= 0)
+        panic("SERVER ERROR: Failed to create socket %s\n", strerror(errno));
+
+    if ((t->evtloop = eloopCreate(server.maxclients)) == NULL)
+        panic("SERVER ERROR: Failed to create eventloop %s\n",
+                strerror(errno));
+
+    eloopAddEvent(t->evtloop, t->sfd, EVT_READ, serverAccept, t);
+
+    if ((t->http = httpMultiCreate(t->evtloop)) == NULL)
+        panic("SERVER ERROR: Failed to create http client\n");
+
+    if ((t->mailbox = workpoolMailboxCreate(t->evtloop)) == NULL)
+        panic("SERVER ERROR: Failed to create mailbox %s\n", strerror(errno));
+
+    /* Housekeeping for shared state only needs doing once */
+    if (id == 0) {
+        eloopAddTimer(t->evtloop, SERVER_CRON_MS, serverCron, NULL);
+        eloopAddTimer(t->evtloop, SERVER_FREQ_MS, serverFreqCron, NULL);
+        eloopAddTimer(t->evtloop, SERVER_SNAPSHOT_MS, serverSnapshotCron,
+                NULL);
+        eloopAddTimer(t->evtloop, PERSIST_WINDOW_MS, serverPersistCron, NULL);
+    }
+}
+
+void *
+serverThreadMain(void *_t)
+{
+    serverThread *t = _t;
+    eloopMain(t->evtloop);
+    return NULL;
+}
+
 void
-serverInit()
+serverInit(int threadcount)
 {
     server.pid = getpid();
 
+    /* A client hanging up while its definition is being fetched must not
+     * take the server down */
+    signal(SIGPIPE, SIG_IGN);
+
+    /* serverCron writes a snapshot before exiting */
+    signal(SIGINT, serverSignalHandler);
+    signal(SIGTERM, serverSignalHandler);
+
     serverSetFileDescriptorLimit();
 
-    if ((server.cache = hmapCreate()) == NULL)
-        panic("SERVER ERROR: Failed to create cache\n");
+    if ((server.inflight = hmapCreateWithType(&serverInflightType)) == NULL)
+        panic("SERVER ERROR: Failed to create in flight table\n");
+
+    pthread_mutex_init(&server.inflightlock, NULL);
+    pthread_mutex_init(&server.cachelock, NULL);
+    pthread_mutex_init(&server.snapshotlock, NULL);
+    pthread_mutex_init(&server.persistlock, NULL);
+    pthread_mutex_init(&server.persistflushlock, NULL);
+
+    if ((server.persistqueue = listNew()) == NULL ||
+            (server.persistpending = hmapCreateWithType(&serverPersistType)) ==
+                    NULL)
+        panic("SERVER ERROR: Failed to create persist queue\n");
+    server.bgsavepid = -1;
+    server.bgsavestatus = SERVER_OK;
 
     if ((server.db = dbConnect(DB_NAME)) == NULL)
         panic("SERVER ERROR: Failed to init database\n");
 
-    if ((server.sfd = inetCreateServerNonBlocking(PORT, NULL, BACKLOG)) <= 0)
-        panic("SERVER ERROR: Failed to create socket %s\n", strerror(errno));
+    /* curl and libxml2 have to be initialised before any other thread
+     * uses them */
+    httpInit();
+    htmlInit();
+
+    if ((server.parsepool = workpoolCreate(PARSE_THREADS)) == NULL)
+        panic("SERVER ERROR: Failed to create parse pool\n");
+
+    /* sqlite serialises everything on a connection anyway, one thread keeps
+     * the statements it uses to itself */
+    if ((server.dbpool = workpoolCreate(1)) == NULL)
+        panic("SERVER ERROR: Failed to create db thread\n");
 
-    if ((server.evtloop = eloopCreate(server.maxclients)) == NULL)
-        panic("SERVER ERROR: Failed to create eventloop\n", strerror(errno));
+    server.threadcount = threadcount;
+    if ((server.threads = calloc(threadcount, sizeof(serverThread))) == NULL)
+        panic("SERVER ERROR: Failed to allocate threads\n");
 
-    eloopAddEvent(server.evtloop, server.sfd, EVT_READ, serverAccept, NULL);
+    for (int i = 0; i < threadcount; ++i)
+        serverThreadInit(&server.threads[i], i);
 
     serverInitDictionary();
-    printf("[%d]: server cache initalized\n", server.pid);
+    if (server.loading)
+        printf("[%d]: server cache loading in the background\n", server.pid);
+}
+
+static void
+serverUsage(char *progname)
+{
+    panic("Usage: %s [-t threads] [-m cache megabytes] [-z]\n", progname);
 }
 
 int
-main(void)
+main(int argc, char **argv)
 {
-    serverInit();
+    int opt, threadcount;
+
+    threadcount = sysconf(_SC_NPROCESSORS_ONLN);
+    while ((opt = getopt(argc, argv, "t:m:z")) != -1) {
+        switch (opt) {
+        case 't':
+            threadcount = atoi(optarg);
+            break;
+        case 'm':
+            server.cachebudget = strtoull(optarg, NULL, 10) << 20;
+            break;
+        case 'z':
+            server.compress = 1;
+            break;
+        default:
+            serverUsage(argv[0]);
+        }
+    }
 
-    printf("[%d]: server started on port :: %d\n", server.pid, PORT);
+    if (threadcount < 1)
+        threadcount = 1;
 
+    /* Has to happen before any threads exist, they do not survive fork() */
 #ifdef DAEMON
     serverDaemonise("");
 #endif
-    eloopMain(server.evtloop);
+    serverInit(threadcount);
+
+    printf("[%d]: server started on port :: %d with %d thread(s)\n",
+            server.pid, PORT, threadcount);
+
+    /* The main thread runs the first loop itself */
+    for (int i = 1; i < threadcount; ++i)
+        if (pthread_create(&server.threads[i].tid, NULL, serverThreadMain,
+                    &server.threads[i]) != 0)
+            panic("SERVER ERROR: Failed to start thread %d\n", i);
+
+    serverThreadMain(&server.threads[0]);
 }
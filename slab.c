@@ -0,0 +1,116 @@
+#include <pthread.h>
+#include <stdlib.h>
+
+#include "slab.h"
+
+#define SLAB_ALIGN 64
+
+/* The block header takes up the first line so objects stay aligned */
+#define _slabFirst(b) ((char *)(b) + SLAB_ALIGN)
+
+slab *
+slabCreate(size_t objsize)
+{
+    slab *s;
+
+    if ((s = malloc(sizeof(slab))) == NULL)
+        return NULL;
+
+    /* Room for the free list link and pointer aligned */
+    if (objsize < sizeof(void *))
+        objsize = sizeof(void *);
+    objsize = (objsize + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+
+    s->objsize = objsize;
+    s->perblock = (SLAB_BLOCK_SIZE - SLAB_ALIGN) / objsize;
+    s->inuse = 0;
+    s->blockcount = 0;
+    s->freelist = NULL;
+    s->blocks = NULL;
+    pthread_mutex_init(&s->lock, NULL);
+
+    return s;
+}
+
+void
+slabRelease(slab *s)
+{
+    slabBlock *b, *next;
+
+    if (s) {
+        for (b = s->blocks; b; b = next) {
+            next = b->next;
+            free(b);
+        }
+        pthread_mutex_destroy(&s->lock);
+        free(s);
+    }
+}
+
+/* Must hold the lock */
+static int
+_slabGrow(slab *s)
+{
+    slabBlock *b;
+    char *obj;
+
+    if ((b = aligned_alloc(SLAB_ALIGN, SLAB_BLOCK_SIZE)) == NULL)
+        return 0;
+
+    b->next = s->blocks;
+    s->blocks = b;
+    s->blockcount++;
+
+    /* Threaded back to front so objects are handed out in address order */
+    obj = _slabFirst(b) + (s->perblock - 1) * s->objsize;
+    for (size_t i = 0; i < s->perblock; ++i, obj -= s->objsize) {
+        *(void **)obj = s->freelist;
+        s->freelist = obj;
+    }
+
+    return 1;
+}
+
+void *
+slabAlloc(slab *s)
+{
+    void *obj;
+
+    pthread_mutex_lock(&s->lock);
+    if (s->freelist == NULL && !_slabGrow(s)) {
+        pthread_mutex_unlock(&s->lock);
+        return NULL;
+    }
+
+    obj = s->freelist;
+    s->freelist = *(void **)obj;
+    s->inuse++;
+    pthread_mutex_unlock(&s->lock);
+
+    return obj;
+}
+
+void
+slabFree(slab *s, void *ptr)
+{
+    if (ptr == NULL)
+        return;
+
+    pthread_mutex_lock(&s->lock);
+    *(void **)ptr = s->freelist;
+    s->freelist = ptr;
+    s->inuse--;
+    pthread_mutex_unlock(&s->lock);
+}
+
+size_t
+slabMemoryUsage(slab *s)
+{
+    size_t usage;
+
+    pthread_mutex_lock(&s->lock);
+    usage = sizeof(slab) + s->blockcount * SLAB_BLOCK_SIZE;
+    pthread_mutex_unlock(&s->lock);
+
+    return usage;
+}
@@ -0,0 +1,34 @@
+#ifndef __SLAB_H__
+#define __SLAB_H__
+
+#include <pthread.h>
+#include <stddef.h>
+
+/* Fixed size objects carved out of cache line aligned blocks, freed objects
+ * go on a free list and are handed out again before a new block is made.
+ * Blocks are only returned when the whole slab is released */
+
+#define SLAB_BLOCK_SIZE (64 * 1024)
+
+typedef struct slabBlock {
+    struct slabBlock *next;
+} slabBlock;
+
+typedef struct slab {
+    size_t objsize;
+    size_t perblock;
+    size_t inuse;
+    size_t blockcount;
+    void *freelist;
+    slabBlock *blocks;
+    pthread_mutex_t lock;
+} slab;
+
+slab *slabCreate(size_t objsize);
+void slabRelease(slab *s);
+void *slabAlloc(slab *s);
+void slabFree(slab *s, void *ptr);
+/* Bytes held in blocks, whether in use or on the free list */
+size_t slabMemoryUsage(slab *s);
+
+#endif
@@ -0,0 +1,410 @@
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "hmap.h"
+#include "snapshot.h"
+
+#define SNAP_BUF_SIZE  (1 << 20)
+#define SNAP_MIN_INDEX 16
+
+#define _snapshotAlign(off) (((off) + 7) & ~(uint64_t)7)
+
+snapshot *
+snapshotOpen(char *path)
+{
+    snapshot *snap;
+    snapshotHeader *h;
+    struct stat st;
+    char *map;
+    int fd;
+
+    if ((fd = open(path, O_RDONLY)) == -1)
+        return NULL;
+
+    if (fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(snapshotHeader))
+        goto error;
+
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED)
+        goto error;
+
+    /* Anything that does not add up is treated as no snapshot at all */
+    h = (snapshotHeader *)map;
+    if (memcmp(h->magic, SNAP_MAGIC, sizeof(h->magic)) != 0 ||
+            h->version != SNAP_VERSION || h->size != (uint64_t)st.st_size ||
+            h->indexcap < SNAP_MIN_INDEX ||
+            (h->indexcap & (h->indexcap - 1)) != 0 ||
+            h->indexcap < h->count || h->entriesoff % 8 || h->indexoff % 8 ||
+            h->entriesoff + (uint64_t)h->count * sizeof(snapshotEntry) >
+                    h->size ||
+            h->indexoff + h->indexcap * sizeof(snapshotSlot) > h->size) {
+        munmap(map, st.st_size);
+        goto error;
+    }
+
+    if ((snap = malloc(sizeof(snapshot))) == NULL) {
+        munmap(map, st.st_size);
+        goto error;
+    }
+
+    /* Lookups jump all over the file */
+    madvise(map, st.st_size, MADV_RANDOM);
+
+    snap->fd = fd;
+    snap->map = map;
+    snap->size = st.st_size;
+    snap->header = h;
+    snap->entries = (snapshotEntry *)(map + h->entriesoff);
+    snap->index = (snapshotSlot *)(map + h->indexoff);
+    snap->mask = h->indexcap - 1;
+    return snap;
+
+error:
+    close(fd);
+    return NULL;
+}
+
+void
+snapshotClose(snapshot *snap)
+{
+    if (snap) {
+        munmap(snap->map, snap->size);
+        close(snap->fd);
+        free(snap);
+    }
+}
+
+uint32_t
+snapshotCount(snapshot *snap)
+{
+    return snap->header->count;
+}
+
+int
+snapshotForEach(snapshot *snap,
+        int (*fn)(void *p, char *key, size_t keylen, char *value,
+                size_t valuelen),
+        void *p)
+{
+    snapshotEntry *e;
+
+    for (uint32_t i = 0; i < snap->header->count; ++i) {
+        e = &snap->entries[i];
+        if (e->keyoff + e->keylen > snap->size ||
+                e->valueoff + e->valuelen > snap->size)
+            continue;
+        if (fn(p, snap->map + e->keyoff, e->keylen, snap->map + e->valueoff,
+                    e->valuelen) == SNAP_ERR)
+            return SNAP_ERR;
+    }
+
+    return SNAP_OK;
+}
+
+const char *
+snapshotGet(snapshot *snap, char *key, size_t keylen, size_t *len)
+{
+    snapshotEntry *e;
+    snapshotSlot *slot;
+    uint64_t hash, i;
+
+    hash = hmapHashBytesSeeded(key, keylen, snap->header->seed);
+    i = hash & snap->mask;
+
+    for (uint64_t probes = 0; probes <= snap->mask; ++probes) {
+        slot = &snap->index[i];
+        if (slot->idx == 0 || slot->idx > snap->header->count)
+            return NULL;
+
+        if (slot->hash == (uint32_t)(hash >> 32)) {
+            e = &snap->entries[slot->idx - 1];
+            if (e->keylen == keylen && e->keyoff + keylen <= snap->size &&
+                    e->valueoff + e->valuelen <= snap->size &&
+                    memcmp(snap->map + e->keyoff, key, keylen) == 0) {
+                *len = e->valuelen;
+                return snap->map + e->valueoff;
+            }
+        }
+        i = (i + 1) & snap->mask;
+    }
+
+    return NULL;
+}
+
+static int
+_snapshotFlush(snapshotWriter *w)
+{
+    size_t written = 0;
+    ssize_t n;
+
+    while (written < w->buflen) {
+        if ((n = write(w->fd, w->buf + written, w->buflen - written)) <= 0)
+            return SNAP_ERR;
+        written += n;
+    }
+
+    w->buflen = 0;
+    return SNAP_OK;
+}
+
+static int
+_snapshotWrite(snapshotWriter *w, const void *data, size_t len)
+{
+    size_t chunk;
+
+    while (len) {
+        if (w->buflen == SNAP_BUF_SIZE && _snapshotFlush(w) == SNAP_ERR)
+            return SNAP_ERR;
+
+        chunk = SNAP_BUF_SIZE - w->buflen;
+        if (chunk > len)
+            chunk = len;
+        memcpy(w->buf + w->buflen, data, chunk);
+        w->buflen += chunk;
+        w->off += chunk;
+        data = (const char *)data + chunk;
+        len -= chunk;
+    }
+
+    return SNAP_OK;
+}
+
+static int
+_snapshotPad(snapshotWriter *w)
+{
+    static const char zeros[8] = {0};
+    return _snapshotWrite(w, zeros, _snapshotAlign(w->off) - w->off);
+}
+
+void
+snapshotTempPath(char *buf, size_t len, char *path, int pid)
+{
+    snprintf(buf, len, "%s.tmp.%d", path, pid);
+}
+
+snapshotWriter *
+snapshotWriterCreate(char *path, int flags)
+{
+    snapshotWriter *w;
+    snapshotHeader h;
+    size_t len;
+
+    if ((w = calloc(1, sizeof(snapshotWriter))) == NULL)
+        return NULL;
+
+    /* The pid keeps a forked writer and its parent apart */
+    len = strlen(path) + 32;
+    if ((w->path = strdup(path)) == NULL ||
+            (w->tmppath = malloc(len)) == NULL ||
+            (w->buf = malloc(SNAP_BUF_SIZE)) == NULL)
+        goto error;
+    snapshotTempPath(w->tmppath, len, path, (int)getpid());
+    w->flags = flags;
+
+    if ((w->fd = open(w->tmppath, O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1)
+        goto error;
+
+    /* Filled in once everything else has been written */
+    memset(&h, 0, sizeof(h));
+    if (_snapshotWrite(w, &h, sizeof(h)) == SNAP_ERR) {
+        snapshotWriterAbort(w);
+        return NULL;
+    }
+
+    return w;
+
+error:
+    free(w->path);
+    free(w->tmppath);
+    free(w->buf);
+    free(w);
+    return NULL;
+}
+
+int
+snapshotWriterAdd(snapshotWriter *w, char *key, size_t keylen, char *value,
+        size_t valuelen)
+{
+    snapshotPending *pending, *p;
+    uint32_t capacity;
+
+    if (keylen > UINT32_MAX || valuelen > UINT32_MAX || w->count == UINT32_MAX)
+        return SNAP_ERR;
+
+    if (w->count == w->capacity) {
+        capacity = w->capacity ? w->capacity * 2 : 1024;
+        pending = realloc(w->pending, sizeof(snapshotPending) * capacity);
+        if (pending == NULL)
+            return SNAP_ERR;
+        w->pending = pending;
+        w->capacity = capacity;
+    }
+
+    p = &w->pending[w->count];
+    if (w->flags & SNAP_BORROW_KEYS) {
+        p->key = key;
+    } else {
+        if ((p->key = malloc(keylen ? keylen : 1)) == NULL)
+            return SNAP_ERR;
+        memcpy(p->key, key, keylen);
+    }
+    p->keylen = keylen;
+    p->valuelen = valuelen;
+    p->valueoff = w->off;
+
+    if (_snapshotWrite(w, value, valuelen) == SNAP_ERR) {
+        if (!(w->flags & SNAP_BORROW_KEYS))
+            free(p->key);
+        return SNAP_ERR;
+    }
+
+    w->count++;
+    return SNAP_OK;
+}
+
+/* By key, then in the order they were added so the first one added of
+ * any duplicates comes first */
+static int
+_snapshotPendingCmp(const void *_a, const void *_b)
+{
+    const snapshotPending *a = _a, *b = _b;
+    uint32_t len = a->keylen < b->keylen ? a->keylen : b->keylen;
+    int cmp;
+
+    if ((cmp = memcmp(a->key, b->key, len)) != 0)
+        return cmp;
+    if (a->keylen != b->keylen)
+        return a->keylen < b->keylen ? -1 : 1;
+    return a->valueoff < b->valueoff ? -1 : a->valueoff > b->valueoff;
+}
+
+static void
+_snapshotWriterRelease(snapshotWriter *w)
+{
+    if (!(w->flags & SNAP_BORROW_KEYS))
+        for (uint32_t i = 0; i < w->count; ++i)
+            free(w->pending[i].key);
+    free(w->pending);
+    free(w->buf);
+    free(w->path);
+    free(w->tmppath);
+    free(w);
+}
+
+void
+snapshotWriterAbort(snapshotWriter *w)
+{
+    if (w) {
+        close(w->fd);
+        unlink(w->tmppath);
+        _snapshotWriterRelease(w);
+    }
+}
+
+int
+snapshotWriterFinish(snapshotWriter *w)
+{
+    snapshotHeader h;
+    snapshotEntry *entries = NULL;
+    snapshotSlot *index = NULL;
+    snapshotPending *p;
+    uint64_t hash, i, mask;
+    uint32_t count = 0;
+
+    qsort(w->pending, w->count, sizeof(snapshotPending), _snapshotPendingCmp);
+
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, SNAP_MAGIC, sizeof(h.magic));
+    h.version = SNAP_VERSION;
+    /* Derived from this process's seed, so it can not be guessed either */
+    h.seed = hmapHashBytes(w->tmppath, strlen(w->tmppath)) ^
+            (uint64_t)time(NULL);
+
+    /* At most half full so probe sequences stay short, duplicates only
+     * leave it emptier */
+    h.indexcap = SNAP_MIN_INDEX;
+    while (h.indexcap < (uint64_t)w->count * 2)
+        h.indexcap <<= 1;
+    mask = h.indexcap - 1;
+
+    if ((entries = malloc(sizeof(snapshotEntry) * (w->count + 1))) == NULL ||
+            (index = calloc(h.indexcap, sizeof(snapshotSlot))) == NULL)
+        goto error;
+
+    if (_snapshotPad(w) == SNAP_ERR)
+        goto error;
+    h.keysoff = w->off;
+
+    for (uint32_t j = 0; j < w->count; ++j) {
+        p = &w->pending[j];
+        if (count && p->keylen == entries[count - 1].keylen &&
+                memcmp(p->key, w->pending[j - 1].key, p->keylen) == 0)
+            continue;
+
+        entries[count].keyoff = w->off;
+        entries[count].keylen = p->keylen;
+        entries[count].valueoff = p->valueoff;
+        entries[count].valuelen = p->valuelen;
+
+        hash = hmapHashBytesSeeded(p->key, p->keylen, h.seed);
+        for (i = hash & mask; index[i].idx; i = (i + 1) & mask)
+            ;
+        index[i].hash = (uint32_t)(hash >> 32);
+        index[i].idx = ++count;
+
+        if (_snapshotWrite(w, p->key, p->keylen) == SNAP_ERR)
+            goto error;
+    }
+    h.count = count;
+
+    if (_snapshotPad(w) == SNAP_ERR)
+        goto error;
+    h.entriesoff = w->off;
+    if (_snapshotWrite(w, entries, sizeof(snapshotEntry) * count) == SNAP_ERR)
+        goto error;
+
+    if (_snapshotPad(w) == SNAP_ERR)
+        goto error;
+    h.indexoff = w->off;
+    if (_snapshotWrite(w, index, sizeof(snapshotSlot) * h.indexcap) ==
+                    SNAP_ERR ||
+            _snapshotFlush(w) == SNAP_ERR)
+        goto error;
+
+    h.size = w->off;
+    if (pwrite(w->fd, &h, sizeof(h), 0) != sizeof(h))
+        goto error;
+
+    /* Only replace the old one with something that is all on disk */
+    if (fsync(w->fd) == -1 || close(w->fd) == -1) {
+        w->fd = -1;
+        goto error;
+    }
+    w->fd = -1;
+
+    if (rename(w->tmppath, w->path) == -1)
+        goto error;
+
+    free(entries);
+    free(index);
+    _snapshotWriterRelease(w);
+    return SNAP_OK;
+
+error:
+    free(entries);
+    free(index);
+    if (w->fd != -1)
+        close(w->fd);
+    unlink(w->tmppath);
+    _snapshotWriterRelease(w);
+    return SNAP_ERR;
+}
@@ -0,0 +1,108 @@
+#ifndef __SNAPSHOT_H__
+#define __SNAPSHOT_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* A read only copy of the dictionary that can be mmapped and used as is.
+ * Integers are in the byte order of the machine that wrote it.
+ *
+ * | header | definitions ... | keys ... | entries | index |
+ *
+ * Entries are sorted by key and point at their key and definition. The
+ * index is open addressed, each slot has part of the key's hash and the
+ * entry number plus 1, 0 when the slot is empty */
+
+#define SNAP_ERR 0
+#define SNAP_OK  1
+
+/* snapshotWriterCreate flags */
+#define SNAP_BORROW_KEYS 1 /* keys stay valid until the writer is finished,
+                              they are not copied */
+
+#define SNAP_MAGIC   "DICTSNAP"
+#define SNAP_VERSION 1
+
+typedef struct snapshotHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t count;
+    uint64_t seed; /* for hmapHashBytesSeeded */
+    uint64_t keysoff;
+    uint64_t entriesoff;
+    uint64_t indexoff;
+    uint64_t indexcap; /* a power of 2 */
+    uint64_t size;     /* of the whole file */
+} snapshotHeader;
+
+typedef struct snapshotEntry {
+    uint64_t keyoff;
+    uint64_t valueoff;
+    uint32_t keylen;
+    uint32_t valuelen;
+} snapshotEntry;
+
+typedef struct snapshotSlot {
+    uint32_t hash;
+    uint32_t idx;
+} snapshotSlot;
+
+typedef struct snapshot {
+    int fd;
+    char *map;
+    size_t size;
+    snapshotHeader *header;
+    snapshotEntry *entries;
+    snapshotSlot *index;
+    uint64_t mask;
+} snapshot;
+
+typedef struct snapshotPending {
+    char *key;
+    uint32_t keylen;
+    uint32_t valuelen;
+    uint64_t valueoff;
+} snapshotPending;
+
+/* Definitions are written out as they are added, only the keys are kept
+ * until the end when they are sorted */
+typedef struct snapshotWriter {
+    int fd;
+    char *path;
+    char *tmppath;
+    uint64_t off;
+    int flags;
+    uint32_t count;
+    uint32_t capacity;
+    snapshotPending *pending;
+    char *buf; /* writes are batched through this */
+    size_t buflen;
+} snapshotWriter;
+
+/* NULL if there is no usable snapshot at `path` */
+snapshot *snapshotOpen(char *path);
+void snapshotClose(snapshot *snap);
+/* Points into the mapping, valid until snapshotClose */
+const char *snapshotGet(snapshot *snap, char *key, size_t keylen,
+        size_t *len);
+uint32_t snapshotCount(snapshot *snap);
+/* Every entry in key order, stops at the first SNAP_ERR from `fn` and
+ * returns it */
+int snapshotForEach(snapshot *snap,
+        int (*fn)(void *p, char *key, size_t keylen, char *value,
+                size_t valuelen),
+        void *p);
+
+/* Writes to a temporary file that replaces `path` in snapshotWriterFinish,
+ * a reader of the old one is not affected */
+snapshotWriter *snapshotWriterCreate(char *path, int flags);
+/* Where the writer in process `pid` puts the file until it is finished */
+void snapshotTempPath(char *buf, size_t len, char *path, int pid);
+int snapshotWriterAdd(snapshotWriter *w, char *key, size_t keylen,
+        char *value, size_t valuelen);
+/* Releases the writer whether or not it succeeds. Keys added more than
+ * once keep the first definition, the others still take up space */
+int snapshotWriterFinish(snapshotWriter *w);
+void snapshotWriterAbort(snapshotWriter *w);
+
+#endif
@@ -0,0 +1,336 @@
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#include <stdlib.h>
+#include <string.h>
+
+#include "hmap.h"
+#include "swmap.h"
+
+#define SW_EMPTY   ((signed char)0x80)
+#define SW_DELETED ((signed char)0xFE)
+
+/* Probing stops before the table is 7/8 full */
+#define _swmapThreashold(capacity) ((capacity) - (capacity) / 8)
+
+/* The type's hash may be weak in its low bits, both halves of the mixed
+ * hash get used: the top for the group, the bottom 7 for the control byte */
+static inline unsigned int
+_swmapMix(unsigned int h)
+{
+    h ^= h >> 16;
+    h *= 0x85ebca6bU;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35U;
+    h ^= h >> 16;
+    return h;
+}
+
+#define _swmapH1(h) ((h) >> 7)
+#define _swmapH2(h) ((signed char)((h)&0x7F))
+
+/* Bit `i` is set when control byte `i` of the group is equal to `c` */
+static inline unsigned int
+_swmapMatch(signed char *group, signed char c)
+{
+#if defined(__SSE2__)
+    __m128i ctrl = _mm_load_si128((__m128i *)group);
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(ctrl, _mm_set1_epi8(c)));
+#else
+    unsigned int bits = 0;
+    for (int i = 0; i < SW_GROUP_SIZE; ++i)
+        if (group[i] == c)
+            bits |= 1U << i;
+    return bits;
+#endif
+}
+
+/* Empty and deleted are the only control bytes with the top bit set */
+static inline unsigned int
+_swmapMatchFree(signed char *group)
+{
+#if defined(__SSE2__)
+    return _mm_movemask_epi8(_mm_load_si128((__m128i *)group));
+#else
+    unsigned int bits = 0;
+    for (int i = 0; i < SW_GROUP_SIZE; ++i)
+        if (group[i] < 0)
+            bits |= 1U << i;
+    return bits;
+#endif
+}
+
+static int
+_swmapAllocTable(swmap *sm, unsigned int capacity)
+{
+    signed char *ctrl;
+    swmapSlot *slots;
+
+    if ((ctrl = aligned_alloc(SW_GROUP_SIZE, capacity)) == NULL)
+        return HM_ERR;
+
+    if ((slots = malloc(sizeof(swmapSlot) * capacity)) == NULL) {
+        free(ctrl);
+        return HM_ERR;
+    }
+
+    memset(ctrl, SW_EMPTY, capacity);
+    sm->ctrl = ctrl;
+    sm->slots = slots;
+    sm->capacity = capacity;
+    sm->tombstones = 0;
+    sm->rebuildThreashold = _swmapThreashold(capacity);
+    return HM_OK;
+}
+
+swmap *
+swmapCreate(hmapType *type)
+{
+    swmap *sm;
+
+    if ((sm = malloc(sizeof(swmap))) == NULL)
+        return NULL;
+
+    hmapInitSeed();
+    if (_swmapAllocTable(sm, SW_MIN_CAPACITY) == HM_ERR) {
+        free(sm);
+        return NULL;
+    }
+
+    sm->size = 0;
+    sm->type = type;
+    return sm;
+}
+
+static void
+_swmapSlotRelease(swmap *sm, swmapSlot *slot)
+{
+    if (sm->type->freekey)
+        hmapKeyRelease(sm, slot->key);
+    if (sm->type->freevalue)
+        hmapValueRelease(sm, slot->value);
+}
+
+void
+swmapRelease(swmap *sm)
+{
+    if (sm) {
+        for (unsigned int i = 0; i < sm->capacity; ++i)
+            if (sm->ctrl[i] >= 0)
+                _swmapSlotRelease(sm, &sm->slots[i]);
+        free(sm->ctrl);
+        free(sm->slots);
+        free(sm);
+    }
+}
+
+/* Returns the slot holding `key` or -1. Groups are visited with triangular
+ * probing which reaches every group as the group count is a power of 2.
+ * When `freeidx` is set it gets the first empty or deleted slot passed on
+ * the way, -1 if there was none */
+static int
+_swmapFind(swmap *sm, void *key, unsigned int hash, int *freeidx)
+{
+    unsigned int mixed, groupmask, group, match, probe, idx;
+    signed char *ctrl;
+
+    mixed = _swmapMix(hash);
+    groupmask = sm->capacity / SW_GROUP_SIZE - 1;
+    group = _swmapH1(mixed) & groupmask;
+    probe = 0;
+    if (freeidx)
+        *freeidx = -1;
+
+    while (1) {
+        ctrl = sm->ctrl + group * SW_GROUP_SIZE;
+        match = _swmapMatch(ctrl, _swmapH2(mixed));
+
+        while (match) {
+            idx = group * SW_GROUP_SIZE + __builtin_ctz(match);
+            if (hmapKeycmp(sm, key, hash, sm->slots[idx].key,
+                        sm->slots[idx].hash))
+                return idx;
+            match &= match - 1;
+        }
+
+        if (freeidx && *freeidx == -1 && (match = _swmapMatchFree(ctrl)))
+            *freeidx = group * SW_GROUP_SIZE + __builtin_ctz(match);
+
+        /* Inserting would have used this empty slot, the key can not be
+         * any further along */
+        if (_swmapMatch(ctrl, SW_EMPTY))
+            return -1;
+
+        if (++probe > groupmask)
+            return -1;
+        group = (group + probe) & groupmask;
+    }
+}
+
+/* First empty or deleted slot along the probe sequence */
+static unsigned int
+_swmapFindFree(swmap *sm, unsigned int hash)
+{
+    unsigned int mixed, groupmask, group, match, probe;
+
+    mixed = _swmapMix(hash);
+    groupmask = sm->capacity / SW_GROUP_SIZE - 1;
+    group = _swmapH1(mixed) & groupmask;
+    probe = 0;
+
+    while ((match = _swmapMatchFree(sm->ctrl + group * SW_GROUP_SIZE)) == 0)
+        group = (group + ++probe) & groupmask;
+
+    return group * SW_GROUP_SIZE + __builtin_ctz(match);
+}
+
+static void
+_swmapSet(swmap *sm, unsigned int idx, void *key, void *value,
+        unsigned int hash)
+{
+    if (sm->ctrl[idx] == SW_DELETED)
+        sm->tombstones--;
+    sm->ctrl[idx] = _swmapH2(_swmapMix(hash));
+    sm->slots[idx].key = key;
+    sm->slots[idx].value = value;
+    sm->slots[idx].hash = hash;
+}
+
+/* Grows when full of live entries, otherwise rebuilds at the same size to
+ * get rid of the tombstones */
+static int
+_swmapRehash(swmap *sm)
+{
+    signed char *oldctrl;
+    swmapSlot *oldslots, *slot;
+    unsigned int oldcapacity, capacity;
+
+    oldctrl = sm->ctrl;
+    oldslots = sm->slots;
+    oldcapacity = sm->capacity;
+
+    capacity = oldcapacity;
+    if (sm->size >= _swmapThreashold(oldcapacity) / 2)
+        capacity <<= 1;
+
+    if (_swmapAllocTable(sm, capacity) == HM_ERR)
+        return HM_ERR;
+
+    for (unsigned int i = 0; i < oldcapacity; ++i) {
+        if (oldctrl[i] >= 0) {
+            slot = &oldslots[i];
+            _swmapSet(sm, _swmapFindFree(sm, slot->hash), slot->key,
+                    slot->value, slot->hash);
+        }
+    }
+
+    free(oldctrl);
+    free(oldslots);
+    return HM_OK;
+}
+
+void *
+swmapGet(swmap *sm, void *key)
+{
+    int idx;
+
+    if ((idx = _swmapFind(sm, key, hmapHash(sm, key), NULL)) == -1)
+        return NULL;
+    return sm->slots[idx].value;
+}
+
+int
+swmapContains(swmap *sm, void *key)
+{
+    if (_swmapFind(sm, key, hmapHash(sm, key), NULL) == -1)
+        return HM_NOT_FOUND;
+    return HM_FOUND;
+}
+
+int
+swmapAdd(swmap *sm, void *key, void *value)
+{
+    unsigned int hash;
+    int idx;
+
+    hash = hmapHash(sm, key);
+    if (_swmapFind(sm, key, hash, &idx) != -1)
+        return HM_FOUND;
+
+    /* The free slot found on the way is gone with the old table */
+    if (sm->size + sm->tombstones >= sm->rebuildThreashold) {
+        if (_swmapRehash(sm) == HM_ERR)
+            return HM_ERR;
+        idx = _swmapFindFree(sm, hash);
+    }
+
+    _swmapSet(sm, idx, key, value, hash);
+    sm->size++;
+    return HM_OK;
+}
+
+int
+swmapDelete(swmap *sm, void *key)
+{
+    signed char *group;
+    int idx;
+
+    if ((idx = _swmapFind(sm, key, hmapHash(sm, key), NULL)) == -1)
+        return HM_NOT_FOUND;
+
+    _swmapSlotRelease(sm, &sm->slots[idx]);
+
+    /* Lookups stop at a group with an empty slot, so if this group has one
+     * nothing can be probing past it and the slot can become empty too */
+    group = sm->ctrl + (idx & ~(SW_GROUP_SIZE - 1));
+    if (_swmapMatch(group, SW_EMPTY)) {
+        sm->ctrl[idx] = SW_EMPTY;
+    } else {
+        sm->ctrl[idx] = SW_DELETED;
+        sm->tombstones++;
+    }
+    sm->size--;
+    return HM_OK;
+}
+
+size_t
+swmapMemoryUsage(swmap *sm)
+{
+    return sizeof(swmap) + (size_t)sm->capacity * (1 + sizeof(swmapSlot));
+}
+
+swmapIterator *
+swmapIteratorCreate(swmap *sm)
+{
+    swmapIterator *iter;
+
+    if ((iter = malloc(sizeof(swmapIterator))) == NULL)
+        return NULL;
+
+    iter->idx = 0;
+    iter->sm = sm;
+    iter->cur = NULL;
+
+    return iter;
+}
+
+void
+swmapIteratorRelease(swmapIterator *iter)
+{
+    if (iter)
+        free(iter);
+}
+
+int
+swmapIteratorGetNext(swmapIterator *iter)
+{
+    while (iter->idx < iter->sm->capacity) {
+        unsigned int idx = iter->idx++;
+        if (iter->sm->ctrl[idx] >= 0) {
+            iter->cur = &iter->sm->slots[idx];
+            return HM_OK;
+        }
+    }
+
+    return HM_ERR;
+}
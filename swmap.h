@@ -0,0 +1,54 @@
+#ifndef __SWMAP_H__
+#define __SWMAP_H__
+
+#include <stddef.h>
+
+#include "hmap.h"
+
+/* An open addressing "swiss" table. Every slot has a control byte holding
+ * 7 bits of its hash, a lookup compares a whole group of them at once and
+ * only calls keycmp on the slots that matched. Slots live in one array so
+ * there is no allocation per entry. `dict-bench map` compares it with hmap,
+ * it only pulls ahead once a table holds tens of thousands of keys */
+
+#define SW_GROUP_SIZE   16
+#define SW_MIN_CAPACITY 16
+
+typedef struct swmapSlot {
+    void *key;
+    void *value;
+    unsigned int hash;
+} swmapSlot;
+
+typedef struct swmap {
+    unsigned int size;
+    unsigned int capacity;
+    unsigned int tombstones;
+    unsigned int rebuildThreashold;
+    hmapType *type;
+    signed char *ctrl;
+    swmapSlot *slots;
+} swmap;
+
+typedef struct swmapIterator {
+    unsigned int idx;
+    swmap *sm;
+    swmapSlot *cur;
+} swmapIterator;
+
+swmap *swmapCreate(hmapType *type);
+void swmapRelease(swmap *sm);
+
+int swmapContains(swmap *sm, void *key);
+int swmapAdd(swmap *sm, void *key, void *value);
+/* The key and value are released through the type's callbacks, if set */
+int swmapDelete(swmap *sm, void *key);
+void *swmapGet(swmap *sm, void *key);
+/* Bytes held by the table itself, not counting keys and values */
+size_t swmapMemoryUsage(swmap *sm);
+
+swmapIterator *swmapIteratorCreate(swmap *sm);
+void swmapIteratorRelease(swmapIterator *iter);
+int swmapIteratorGetNext(swmapIterator *iter);
+
+#endif
@@ -0,0 +1,195 @@
+#include <dirent.h>
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "inet.h"
+#include "panic.h"
+#include "proto.h"
+
+#define PORT 5050
+
+/* Runs a server in an empty directory and sends it frames it has to turn
+ * away without falling over */
+
+typedef struct testCase {
+    char *name;
+    int opcode;
+    char *key;
+    size_t keylen;
+    int status; /* TEST_ANY_STATUS for any reply at all */
+} testCase;
+
+#define TEST_ANY_STATUS -1
+
+static char nulkey[PROTO_MAX_KEYLEN];
+static char longkey[PROTO_MAX_KEYLEN];
+
+static testCase tests[] = {
+    {"key with a NUL", PROTO_OP_DEFINE, nulkey, 204,
+            PROTO_STATUS_BAD_REQUEST},
+    {"key with a slash", PROTO_OP_DEFINE, "../admin", 8,
+            PROTO_STATUS_BAD_REQUEST},
+    {"key with a space", PROTO_OP_DEFINE, "a b", 3, PROTO_STATUS_BAD_REQUEST},
+    {"key with a query", PROTO_OP_DEFINE, "a?b=%00", 7,
+            PROTO_STATUS_BAD_REQUEST},
+    {"key with a high byte", PROTO_OP_DEFINE, "caf\xc3\xa9", 5,
+            PROTO_STATUS_BAD_REQUEST},
+    {"stats key with a NUL", PROTO_OP_STATS, nulkey, 204,
+            PROTO_STATUS_BAD_REQUEST},
+    {"empty define", PROTO_OP_DEFINE, "", 0, PROTO_STATUS_BAD_REQUEST},
+    /* Valid, there is no network to look it up on but it gets an answer */
+    {"longest key", PROTO_OP_DEFINE, longkey, PROTO_MAX_KEYLEN,
+            TEST_ANY_STATUS},
+    /* Still answering after all of the above */
+    {"stats", PROTO_OP_STATS, "", 0, PROTO_STATUS_OK},
+};
+
+static int
+testReadFull(int sockfd, char *buf, size_t len)
+{
+    ssize_t rbytes;
+    size_t total = 0;
+
+    while (total < len) {
+        if ((rbytes = read(sockfd, buf + total, len - total)) <= 0)
+            return 0;
+        total += rbytes;
+    }
+
+    return 1;
+}
+
+static pid_t
+testStartServer(char *server, char *dir)
+{
+    pid_t pid;
+
+    if ((pid = fork()) < 0)
+        panic("Failed to fork() %s\n", strerror(errno));
+
+    if (pid == 0) {
+        if (chdir(dir) < 0)
+            _exit(1);
+        if (freopen("/dev/null", "w", stdout) == NULL)
+            _exit(1);
+        execl(server, server, "-t", "1", "-m", "1", (char *)NULL);
+        _exit(1);
+    }
+
+    return pid;
+}
+
+static int
+testConnect(void)
+{
+    int sockfd;
+
+    for (int i = 0; i < 100; ++i) {
+        if ((sockfd = inetConnect(NULL, PORT, 0)) != INET_ERR)
+            return sockfd;
+        usleep(50000);
+    }
+
+    panic("Failed to connect to the server\n");
+    return -1;
+}
+
+static void
+testRemoveDir(char *dir)
+{
+    char path[PATH_MAX];
+    struct dirent *ent;
+    DIR *dp;
+
+    if ((dp = opendir(dir)) == NULL)
+        return;
+
+    while ((ent = readdir(dp)) != NULL) {
+        if (!strcmp(ent->d_name, ".") || !strcmp(ent->d_name, ".."))
+            continue;
+        snprintf(path, sizeof(path), "%s/%s", dir, ent->d_name);
+        unlink(path);
+    }
+    closedir(dp);
+    rmdir(dir);
+}
+
+int
+main(int argc, char **argv)
+{
+    unsigned char msg[PROTO_REQ_HEADER_LEN + PROTO_MAX_KEYLEN];
+    unsigned char header[PROTO_RES_HEADER_LEN];
+    char server[PATH_MAX], dir[] = "/tmp/dict-test.XXXXXX", *body;
+    int sockfd, failed, count, status;
+    protoResponse res;
+    size_t len;
+    pid_t pid;
+
+    if (realpath(argc > 1 ? argv[1] : "./dict-server", server) == NULL)
+        panic("Usage: %s [dict-server]\n", argv[0]);
+
+    if (mkdtemp(dir) == NULL)
+        panic("Failed to create %s %s\n", dir, strerror(errno));
+
+    memcpy(nulkey, "zz", 2);
+    memset(nulkey + 3, 'q', sizeof(nulkey) - 3);
+    memset(longkey, 'a', sizeof(longkey));
+
+    pid = testStartServer(server, dir);
+    sockfd = testConnect();
+
+    /* All on one connection, the replies come back in order */
+    count = sizeof(tests) / sizeof(tests[0]);
+    for (int i = 0; i < count; ++i) {
+        protoEncodeRequestHeader(msg, tests[i].opcode, 0, tests[i].keylen);
+        memcpy(msg + PROTO_REQ_HEADER_LEN, tests[i].key, tests[i].keylen);
+        len = PROTO_REQ_HEADER_LEN + tests[i].keylen;
+        if (write(sockfd, msg, len) != (ssize_t)len)
+            panic("Failed to write to server %s\n", strerror(errno));
+    }
+
+    failed = 0;
+    for (int i = 0; i < count; ++i) {
+        if (!testReadFull(sockfd, (char *)header, sizeof(header)) ||
+                protoDecodeResponseHeader(header, &res) != PROTO_OK) {
+            printf("FAIL %s: no reply\n", tests[i].name);
+            failed = count - i;
+            break;
+        }
+
+        if ((body = malloc(res.len + 1)) == NULL ||
+                !testReadFull(sockfd, body, res.len)) {
+            free(body);
+            printf("FAIL %s: short reply\n", tests[i].name);
+            failed = count - i;
+            break;
+        }
+        free(body);
+
+        if (tests[i].status != TEST_ANY_STATUS &&
+                res.status != tests[i].status) {
+            printf("FAIL %s: status %d, wanted %d\n", tests[i].name,
+                    res.status, tests[i].status);
+            failed++;
+        } else {
+            printf("ok   %s\n", tests[i].name);
+        }
+    }
+
+    close(sockfd);
+    kill(pid, SIGTERM);
+    if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status)) {
+        printf("FAIL server did not exit cleanly\n");
+        failed++;
+    }
+    testRemoveDir(dir);
+
+    printf("%d of %d failed\n", failed, count);
+    return failed ? 1 : 0;
+}
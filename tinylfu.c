@@ -0,0 +1,124 @@
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "tinylfu.h"
+
+/* Counters are read and written from every thread, relaxed atomics make
+ * that well defined without costing anything over plain loads and stores */
+#define _tinylfuLoad(p)     __atomic_load_n(&(p), __ATOMIC_RELAXED)
+#define _tinylfuStore(p, v) __atomic_store_n(&(p), (v), __ATOMIC_RELAXED)
+
+/* Double hashing, row `i` looks at h1 + i * h2. h2 is odd so the rows
+ * never collapse onto the same counter */
+static inline unsigned int
+_tinylfuIndex(tinylfu *t, uint64_t hash, int row)
+{
+    uint32_t h1 = (uint32_t)hash;
+    uint32_t h2 = (uint32_t)(hash >> 32) | 1;
+    return row * t->width + ((h1 + row * h2) & t->mask);
+}
+
+tinylfu *
+tinylfuCreate(size_t expected)
+{
+    tinylfu *t;
+    unsigned int width;
+
+    if ((t = malloc(sizeof(tinylfu))) == NULL)
+        return NULL;
+
+    width = TINYLFU_MIN_WIDTH;
+    while (width < expected && width < (1U << 26))
+        width <<= 1;
+
+    if ((t->counters = calloc(TINYLFU_DEPTH, width)) == NULL) {
+        free(t);
+        return NULL;
+    }
+
+    t->width = width;
+    t->mask = width - 1;
+    t->samplesize = width * 10;
+    t->additions = 0;
+    t->resets = 0;
+    t->admitted = 0;
+    t->rejected = 0;
+
+    return t;
+}
+
+void
+tinylfuRelease(tinylfu *t)
+{
+    if (t) {
+        free(t->counters);
+        free(t);
+    }
+}
+
+/* Only the thread that hit the sample size gets here. Increments racing
+ * with it can be lost or halved twice, neither matters for an estimate */
+static void
+_tinylfuReset(tinylfu *t)
+{
+    unsigned int total = TINYLFU_DEPTH * t->width;
+
+    for (unsigned int i = 0; i < total; ++i)
+        _tinylfuStore(t->counters[i], _tinylfuLoad(t->counters[i]) >> 1);
+
+    __atomic_sub_fetch(&t->additions, t->samplesize / 2, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&t->resets, 1, __ATOMIC_RELAXED);
+}
+
+void
+tinylfuIncrement(tinylfu *t, uint64_t hash)
+{
+    unsigned int idx;
+    unsigned char c;
+    int added = 0;
+
+    for (int i = 0; i < TINYLFU_DEPTH; ++i) {
+        idx = _tinylfuIndex(t, hash, i);
+        if ((c = _tinylfuLoad(t->counters[idx])) < TINYLFU_MAX) {
+            _tinylfuStore(t->counters[idx], c + 1);
+            added = 1;
+        }
+    }
+
+    /* A key already at the maximum everywhere does not age the sketch */
+    if (added && __atomic_add_fetch(&t->additions, 1, __ATOMIC_RELAXED) ==
+            t->samplesize)
+        _tinylfuReset(t);
+}
+
+unsigned int
+tinylfuEstimate(tinylfu *t, uint64_t hash)
+{
+    unsigned int min = TINYLFU_MAX, c;
+
+    for (int i = 0; i < TINYLFU_DEPTH; ++i)
+        if ((c = _tinylfuLoad(t->counters[_tinylfuIndex(t, hash, i)])) < min)
+            min = c;
+
+    return min;
+}
+
+void
+tinylfuCounters(tinylfu *t, uint64_t hash,
+        unsigned int counters[TINYLFU_DEPTH])
+{
+    for (int i = 0; i < TINYLFU_DEPTH; ++i)
+        counters[i] = _tinylfuLoad(t->counters[_tinylfuIndex(t, hash, i)]);
+}
+
+int
+tinylfuAdmit(tinylfu *t, uint64_t candidate, uint64_t victim)
+{
+    if (tinylfuEstimate(t, candidate) > tinylfuEstimate(t, victim)) {
+        __atomic_add_fetch(&t->admitted, 1, __ATOMIC_RELAXED);
+        return 1;
+    }
+
+    __atomic_add_fetch(&t->rejected, 1, __ATOMIC_RELAXED);
+    return 0;
+}
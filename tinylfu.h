@@ -0,0 +1,43 @@
+#ifndef __TINYLFU_H__
+#define __TINYLFU_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* TinyLFU admission. A count-min sketch keeps an approximate count of how
+ * often each key has been asked for recently, a new entry is only let in
+ * over the entry it would evict if it has been asked for more often. All
+ * counters are halved every `samplesize` increments so old popularity
+ * fades. Safe to use from any thread, counts may be slightly off when two
+ * threads increment the same counter at once */
+
+#define TINYLFU_DEPTH     4
+#define TINYLFU_MAX       15 /* counters saturate here, as 4 bit counters */
+#define TINYLFU_MIN_WIDTH 1024
+
+typedef struct tinylfu {
+    unsigned int width; /* counters per row, a power of 2 */
+    unsigned int mask;
+    unsigned int samplesize;
+    unsigned int additions; /* since the last halving */
+    unsigned long long resets;
+    unsigned long long admitted;
+    unsigned long long rejected;
+    unsigned char *counters; /* TINYLFU_DEPTH rows of `width` */
+} tinylfu;
+
+/* Sized for about `expected` distinct keys */
+tinylfu *tinylfuCreate(size_t expected);
+void tinylfuRelease(tinylfu *t);
+
+/* `hash` should be a full 64 bit hash of the key, each row uses different
+ * bits of it */
+void tinylfuIncrement(tinylfu *t, uint64_t hash);
+unsigned int tinylfuEstimate(tinylfu *t, uint64_t hash);
+/* Copies out the counter `hash` maps to in each row */
+void tinylfuCounters(tinylfu *t, uint64_t hash,
+        unsigned int counters[TINYLFU_DEPTH]);
+/* Whether `candidate` should replace `victim`, ties keep the victim */
+int tinylfuAdmit(tinylfu *t, uint64_t candidate, uint64_t victim);
+
+#endif
@@ -0,0 +1,221 @@
+#if defined(__linux__)
+#include <sys/eventfd.h>
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "eloop.h"
+#include "list.h"
+#include "panic.h"
+#include "workpool.h"
+
+static void *
+_workpoolThreadMain(void *_wp)
+{
+    workpool *wp = _wp;
+    workpoolJob *job;
+    workpoolMailbox *mb;
+
+    while (1) {
+        pthread_mutex_lock(&wp->lock);
+        while (wp->jobs->len == 0 && !wp->shutdown)
+            pthread_cond_wait(&wp->cond, &wp->lock);
+
+        if (wp->shutdown && wp->jobs->len == 0) {
+            pthread_mutex_unlock(&wp->lock);
+            break;
+        }
+        job = listRemoveHead(wp->jobs);
+        pthread_mutex_unlock(&wp->lock);
+
+        job->work(job->arg);
+
+        /* Once queued the mailbox's loop can run and free the job */
+        if ((mb = job->mailbox) != NULL) {
+            listTSAddTail(mb->completed, job);
+            workpoolMailboxPost(mb, NULL, NULL);
+        } else {
+            free(job);
+        }
+    }
+
+    return NULL;
+}
+
+workpool *
+workpoolCreate(int threadcount)
+{
+    workpool *wp;
+
+    if ((wp = malloc(sizeof(workpool))) == NULL)
+        return NULL;
+
+    if ((wp->threads = malloc(sizeof(pthread_t) * threadcount)) == NULL) {
+        free(wp);
+        return NULL;
+    }
+
+    wp->threadcount = 0;
+    wp->shutdown = 0;
+    wp->jobs = listNew();
+    pthread_mutex_init(&wp->lock, NULL);
+    pthread_cond_init(&wp->cond, NULL);
+
+    for (int i = 0; i < threadcount; ++i) {
+        if (pthread_create(&wp->threads[i], NULL, _workpoolThreadMain, wp) !=
+                0) {
+            workpoolRelease(wp);
+            return NULL;
+        }
+        wp->threadcount++;
+    }
+
+    return wp;
+}
+
+/* Lets the queued jobs finish before joining the threads */
+void
+workpoolRelease(workpool *wp)
+{
+    if (wp) {
+        pthread_mutex_lock(&wp->lock);
+        wp->shutdown = 1;
+        pthread_cond_broadcast(&wp->cond);
+        pthread_mutex_unlock(&wp->lock);
+
+        for (int i = 0; i < wp->threadcount; ++i)
+            pthread_join(wp->threads[i], NULL);
+
+        listSetFreedata(wp->jobs, free);
+        listRelease(wp->jobs);
+        pthread_mutex_destroy(&wp->lock);
+        pthread_cond_destroy(&wp->cond);
+        free(wp->threads);
+        free(wp);
+    }
+}
+
+int
+workpoolSubmit(workpool *wp, workpoolMailbox *mb, workpoolFn *work,
+        workpoolFn *done, void *arg)
+{
+    workpoolJob *job;
+
+    if ((job = malloc(sizeof(workpoolJob))) == NULL)
+        return WP_ERR;
+
+    job->work = work;
+    job->done = done;
+    job->arg = arg;
+    job->mailbox = mb;
+
+    pthread_mutex_lock(&wp->lock);
+    listAddTail(wp->jobs, job);
+    pthread_cond_signal(&wp->cond);
+    pthread_mutex_unlock(&wp->lock);
+
+    return WP_OK;
+}
+
+static void
+_workpoolMailboxDrain(eloop *el, int fd, void *data, int mask)
+{
+    (void)el;
+    (void)mask;
+    workpoolMailbox *mb = data;
+    workpoolJob *job;
+    char buf[64];
+
+    /* Wake ups are coalesced, one read clears all of them */
+    while (read(fd, buf, sizeof(buf)) > 0)
+        ;
+
+    while ((job = listTSRemoveHead(mb->completed)) != NULL) {
+        if (job->done)
+            job->done(job->arg);
+        free(job);
+    }
+}
+
+workpoolMailbox *
+workpoolMailboxCreate(eloop *el)
+{
+    workpoolMailbox *mb;
+
+    if ((mb = malloc(sizeof(workpoolMailbox))) == NULL)
+        return NULL;
+
+#if defined(__linux__)
+    if ((mb->rfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1) {
+        free(mb);
+        return NULL;
+    }
+    mb->wfd = mb->rfd;
+#else
+    int fds[2];
+
+    if (pipe(fds) == -1) {
+        free(mb);
+        return NULL;
+    }
+    fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL, 0) | O_NONBLOCK);
+    fcntl(fds[1], F_SETFL, fcntl(fds[1], F_GETFL, 0) | O_NONBLOCK);
+    mb->rfd = fds[0];
+    mb->wfd = fds[1];
+#endif
+
+    mb->el = el;
+    mb->completed = listTSNew();
+
+    if (eloopAddEvent(el, mb->rfd, EVT_READ, _workpoolMailboxDrain, mb) ==
+            EVT_ERR) {
+        workpoolMailboxRelease(mb);
+        return NULL;
+    }
+
+    return mb;
+}
+
+void
+workpoolMailboxRelease(workpoolMailbox *mb)
+{
+    if (mb) {
+        eloopDeleteEvent(mb->el, mb->rfd, EVT_READ);
+        close(mb->rfd);
+        if (mb->wfd != mb->rfd)
+            close(mb->wfd);
+        listSetFreedata(mb->completed, free);
+        listRelease(mb->completed);
+        free(mb);
+    }
+}
+
+/* Safe to call from any thread, `done` is run on the mailbox's eventloop.
+ * Passing a NULL `done` only wakes the loop up */
+int
+workpoolMailboxPost(workpoolMailbox *mb, workpoolFn *done, void *arg)
+{
+    uint64_t one = 1;
+    workpoolJob *job;
+
+    if (done) {
+        if ((job = malloc(sizeof(workpoolJob))) == NULL)
+            return WP_ERR;
+        job->work = NULL;
+        job->done = done;
+        job->arg = arg;
+        job->mailbox = mb;
+        listTSAddTail(mb->completed, job);
+    }
+
+    /* A full pipe or eventfd means a wake up is already pending */
+    if (write(mb->wfd, &one, sizeof(one)) == -1 && errno != EAGAIN)
+        warning("WORKPOOL ERROR: Failed to notify eventloop\n");
+
+    return WP_OK;
+}
@@ -0,0 +1,48 @@
+#ifndef __WORKPOOL_H__
+#define __WORKPOOL_H__
+
+#include <pthread.h>
+
+#include "eloop.h"
+#include "list.h"
+
+#define WP_ERR 0
+#define WP_OK  1
+
+typedef void workpoolFn(void *arg);
+
+/* Completed jobs are posted here from any thread and handed back to the
+ * eventloop that owns the mailbox once the notification fd is readable */
+typedef struct workpoolMailbox {
+    int rfd;
+    int wfd;
+    eloop *el;
+    list *completed;
+} workpoolMailbox;
+
+typedef struct workpoolJob {
+    workpoolFn *work; /* runs on a pool thread */
+    workpoolFn *done; /* runs on the mailbox's eventloop */
+    void *arg;
+    workpoolMailbox *mailbox;
+} workpoolJob;
+
+typedef struct workpool {
+    int threadcount;
+    int shutdown;
+    pthread_t *threads;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    list *jobs;
+} workpool;
+
+workpool *workpoolCreate(int threadcount);
+void workpoolRelease(workpool *wp);
+int workpoolSubmit(workpool *wp, workpoolMailbox *mb, workpoolFn *work,
+        workpoolFn *done, void *arg);
+
+workpoolMailbox *workpoolMailboxCreate(eloop *el);
+void workpoolMailboxRelease(workpoolMailbox *mb);
+int workpoolMailboxPost(workpoolMailbox *mb, workpoolFn *done, void *arg);
+
+#endif